@@ -0,0 +1,86 @@
+#pragma once
+
+#include <MqttOta.h>
+
+#include <vector>
+
+/** OtaWriter which writes the image to RAM instead of the update partition,
+ * to run MqttOta's chunk pipeline on the host.
+ *
+ * The MD5 digest is not verified, compare image() against the source
+ * instead. end() fails unless every byte was written exactly once.
+ */
+class FakeOtaWriter
+  : public OtaWriter
+{
+public:
+  FakeOtaWriter(bool seekable = false)
+    : m_seekable(seekable)
+    , m_numWritten(0)
+    , m_numBegins(0)
+    , m_numAborts(0)
+  { }
+
+  bool
+  begin(size_t imageSize, const char *md5) override
+  {
+    (void)md5;
+    m_image.assign(imageSize, 0);
+    m_written.assign(imageSize, false);
+    m_numWritten = 0;
+    m_numBegins++;
+    return true;
+  }
+
+  bool
+  seekable() const override
+  {
+    return m_seekable;
+  }
+
+  bool
+  write(size_t offset, const uint8_t *data, size_t len) override
+  {
+    if (offset + len > m_image.size()) {
+      return false;
+    }
+    for (size_t i = offset; i < offset + len; i++) {
+      if (m_written[i]) {
+        return false;
+      }
+      m_written[i] = true;
+    }
+    memcpy(m_image.data() + offset, data, len);
+    m_numWritten += len;
+    return true;
+  }
+
+  bool
+  end() override
+  {
+    return m_numWritten == m_image.size();
+  }
+
+  void
+  abort() override
+  {
+    m_numAborts++;
+  }
+
+  const std::vector<uint8_t> &
+  image() const
+  {
+    return m_image;
+  }
+
+  unsigned long numBegins() const { return m_numBegins; }
+  unsigned long numAborts() const { return m_numAborts; }
+
+private:
+  bool m_seekable;
+  std::vector<uint8_t> m_image;
+  std::vector<bool> m_written;
+  size_t m_numWritten;
+  unsigned long m_numBegins;
+  unsigned long m_numAborts;
+};
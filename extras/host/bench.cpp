@@ -0,0 +1,374 @@
+/* Host benchmark of the client's hot paths, see README.md.
+ *
+ * Runs benchmarkClient() against the simulated platform and broker, pushes
+ * a firmware image through MqttOta, then times recovery from scripted WiFi
+ * and broker faults and the awake time of deep sleep duty cycles. Results go to stdout
+ * as "bench,..." CSV lines, log output to stderr. Exits non-zero if a sanity
+ * check fails, so ctest catches regressions.
+ */
+
+#include <MqttClient.h>
+#include <MqttDutyCycle.h>
+#include <MqttOta.h>
+
+#include "FakeOtaWriter.h"
+
+#include <string>
+#include <vector>
+
+typedef FlashSettings<FlashDataMqttClient> Settings;
+
+void
+PrintVersion(Print &print)
+{
+  print << "MqttClient host bench\n";
+}
+
+/** Writes to a file and keeps a copy for the checks */
+class CapturePrint
+  : public Print
+{
+public:
+  CapturePrint(FILE *file)
+    : m_file(file)
+  { }
+
+  size_t
+  write(uint8_t c) override
+  {
+    return write(&c, 1);
+  }
+
+  size_t
+  write(const uint8_t *buffer, size_t size) override
+  {
+    m_text.append(reinterpret_cast<const char *>(buffer), size);
+    return fwrite(buffer, 1, size, m_file);
+  }
+
+  int
+  availableForWrite() override
+  {
+    return 1024;
+  }
+
+  /** Extra column of the "bench,<name>,..." line, -1 if missing */
+  long
+  extra(const char *name) const
+  {
+    std::string key = std::string("bench,") + name + ",";
+    size_t pos = m_text.find(key);
+    if (pos == std::string::npos) {
+      return -1;
+    }
+    size_t end = m_text.find('\n', pos);
+    size_t comma = m_text.rfind(',', end);
+    return atol(m_text.c_str() + comma + 1);
+  }
+
+private:
+  FILE *m_file;
+  std::string m_text;
+};
+
+static int s_failures = 0;
+
+static void
+check(bool ok, const char *what)
+{
+  if (not ok) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    s_failures++;
+  }
+}
+
+/** Run the network manager until MQTT is connected, advancing the simulated
+ * clock by stepMs per run()
+ * @return Simulated milliseconds it took, 0 on timeout
+ */
+static unsigned long
+runUntilConnected(NetworkManager &networkManager, unsigned long stepMs, unsigned long timeoutMs)
+{
+  unsigned long start = millis();
+  while (millis() - start < timeoutMs) {
+    networkManager.run();
+    if (networkManager.getMqttClient().connected()) {
+      return millis() - start;
+    }
+    simAdvance(stepMs);
+  }
+  return 0;
+}
+
+/** Fault scenarios report the simulated recovery time, the extra column is
+ * the number of broker connects it took
+ */
+static void
+reportFault(Print &out, const char *name, unsigned long recoveryMs, unsigned long connects)
+{
+  out << "bench,fault." << name << ",1," << recoveryMs * 1000UL << "," << recoveryMs * 1000000UL << "," << connects << "\n";
+}
+
+/** Firmware update through the broker: a sender client publishes a 64 kB
+ * image in 1 kB chunks, ota writes it to a fake flash. A malformed begin
+ * message during the transfer must be rejected without disturbing it. The
+ * extra column is the chunk size.
+ */
+static void
+benchOta(Print &out, NetworkManager &networkManager, MqttOta<> &ota, FakeOtaWriter &writer)
+{
+  static const size_t ImageSize = 64 * 1024;
+  static const size_t ChunkSize = 1024;
+  static const size_t NumChunks = ImageSize / ChunkSize;
+
+  std::vector<uint8_t> image(ImageSize);
+  for (size_t i = 0; i < ImageSize; i++) {
+    image[i] = static_cast<uint8_t>(i * 7 + (i >> 8));
+  }
+
+  WiFiClient socket;
+  PubSubClient sender(socket);
+  sender.setBufferSize(ChunkSize + 128);
+  sender.connect("ota-sender", "", "");
+
+  std::string prefix = networkManager.topicPrefix();
+  std::string beginTopic = prefix + "/ota/begin";
+  std::string chunkTopic = prefix + "/ota/chunk";
+
+  char begin[80];
+  snprintf(begin, sizeof(begin), "%u %u 0123456789abcdef0123456789abcdef",
+           static_cast<unsigned>(ImageSize), static_cast<unsigned>(ChunkSize));
+  sender.publish(beginTopic.c_str(), begin);
+  networkManager.run();
+  sender.publish(beginTopic.c_str(), "garbage");
+  networkManager.run();
+  ota.run();
+
+  std::vector<uint8_t> chunk(4 + ChunkSize);
+  uint32_t idx = 0;
+  Benchmark bench(out);
+  bench.run("ota.chunk", NumChunks, [&]() {
+    chunk[0] = idx >> 24;
+    chunk[1] = idx >> 16;
+    chunk[2] = idx >> 8;
+    chunk[3] = idx;
+    memcpy(chunk.data() + 4, image.data() + idx * ChunkSize, ChunkSize);
+    sender.publish(chunkTopic.c_str(), chunk.data(), chunk.size());
+    networkManager.run();
+    ota.run();
+    idx++;
+  }, ChunkSize);
+
+  check(ota.getState() == MqttOta<>::StateDone, "OTA transfer completed");
+  check(writer.image() == image, "OTA image written intact");
+  check(writer.numBegins() == 1 and writer.numAborts() == 0, "malformed OTA begin rejected");
+}
+
+/** Battery operation: each cycle boots a fresh network manager, publishes a
+ * reading through DutyCycle and goes to deep sleep. The total_us column is
+ * the simulated time awake, the extra column 1 if the access point was
+ * joined without a scan. Runs last, it starts the clock over for each cycle.
+ */
+static void
+benchDutyCycle(Print &out, Print &log, const Settings &settings)
+{
+  static const unsigned long NumCycles = 5;
+  static const unsigned long SleepS = 300;
+  static const unsigned long StepMs = 10;
+
+  Settings sensorSettings = settings;
+  strcpy(sensorSettings.mqttClientName, "sensor");
+
+  uint64_t sleepUs = 0;
+  simSetDeepSleepHook([&](uint64_t us) { sleepUs = us; });
+
+  for (unsigned long cycle = 1; cycle <= NumCycles; cycle++) {
+    simReset();
+    sleepUs = 0;
+
+    /* all RAM state is lost in deep sleep, only the RTC memory is kept */
+    TelnetClient telnetClients[1];
+    NetworkManager networkManager(log, sensorSettings, telnetClients, 1);
+    DutyCycle<> dutyCycle(networkManager);
+    dutyCycle.enqueue("sensor/temp", "21.5");
+    dutyCycle.begin(SleepS);
+    while (not sleepUs and millis() < 2 * DutyCycle<>::DefaultAwakeBudgetMs) {
+      dutyCycle.run();
+      simAdvance(StepMs);
+    }
+
+    const DutyCycleState &st = dutyCycle.getRetainedState();
+    std::string name = "duty.cycle" + std::to_string(cycle);
+    out << "bench," << name.c_str() << ",1," << st.lastAwakeMs * 1000UL << "," << st.lastAwakeMs * 1000000UL
+        << "," << static_cast<unsigned>(st.lastFastJoin) << "\n";
+
+    check(sleepUs == SleepS * 1000000ULL, "duty cycle ends in deep sleep");
+    check(cycle == 1 or st.lastFastJoin, "duty cycle joins without scan after the first cycle");
+  }
+  simSetDeepSleepHook(nullptr);
+
+  /* a fresh boot reads back the counters of all cycles */
+  simReset();
+  TelnetClient telnetClients[1];
+  NetworkManager networkManager(log, sensorSettings, telnetClients, 1);
+  DutyCycle<> dutyCycle(networkManager);
+  dutyCycle.begin(SleepS);
+  const DutyCycleState &st = dutyCycle.getRetainedState();
+  check(st.numCycles == NumCycles + 1 and st.numConfirmed == NumCycles and st.numFailed == 0,
+        "every duty cycle confirmed");
+}
+
+int
+main()
+{
+  static const unsigned long StepMs = 100;
+  static const unsigned long TimeoutMs = 15 * 60 * 1000UL;
+
+  CapturePrint out(stdout);
+  CapturePrint log(stderr);
+
+  Settings settings;
+  strcpy(settings.wifiSsid, "sim");
+  strcpy(settings.wifiPass, "simsimsim");
+  strcpy(settings.mqttServer, "broker.sim");
+  strcpy(settings.mqttClientName, "bench");
+
+  TelnetClient telnetClients[1];
+  NetworkManager networkManager(log, settings, telnetClients, 1);
+  networkManager.setLocalServices(false);
+  networkManager.begin();
+  check(runUntilConnected(networkManager, StepMs, TimeoutMs) or networkManager.getMqttClient().connected(),
+        "initial connect");
+
+  /* counts the CLI responses published by the cli.dispatch benchmark */
+  WiFiClient observerSocket;
+  PubSubClient observer(observerSocket);
+  unsigned long numResponses = 0;
+  std::string response;
+  observer.setCallback([&](char *, uint8_t *payload, unsigned int length) {
+    numResponses++;
+    response.assign(reinterpret_cast<const char *>(payload), length);
+  });
+  observer.connect("observer", "", "");
+  observer.subscribe("bench/cli/response");
+
+  benchmarkClient<CliMqttClient<Settings>>(out, networkManager, settings);
+  observer.loop();
+
+  check(out.extra("publish.small.sent") == 100, "all benchmark messages sent");
+  check(out.extra("mqtt.reconnect.ok") == 3, "all benchmark reconnects succeeded");
+  check(numResponses == 20, "a response for every CLI batch");
+  check(response.find("@bench\nMQTT port: 1883\n") == 0 and response.find("RSSI: -55 dB") != std::string::npos,
+        "CLI batch executed");
+
+  /* remote CLI: invalid settings are not stored, secrets are masked */
+  MqttCliStream<> cliStream(networkManager);
+  CliMqttClient<Settings> cli(cliStream, settings, networkManager);
+  auto runBatch = [&](const char *batch) {
+    cliStream.feed(batch, strlen(batch));
+    while (cliStream.busy()) {
+      cli.run();
+      cliStream.run();
+    }
+    networkManager.run();
+    observer.loop();
+  };
+  strcpy(settings.mqttPass, "secret");
+  runBatch("@client\nm.client bad/name\n");
+  check(strcmp(settings.mqttClientName, "bench") == 0 and response.find("not changed") != std::string::npos,
+        "invalid client name rejected");
+  runBatch("@pass\nm.pass\n");
+  check(response.find("@pass\nMQTT password: ********") == 0, "password masked in remote response");
+  settings.mqttPass[0] = 0;
+
+  /* the OTA handlers stay subscribed, so ota outlives the scenario */
+  FakeOtaWriter otaWriter;
+  MqttOta<> ota(networkManager, otaWriter);
+  ota.setRebootOnSuccess(false);
+  ota.begin();
+  benchOta(out, networkManager, ota, otaWriter);
+
+  /* components follow a changed topic prefix without a new begin() */
+  strcpy(settings.mqttClientName, "bench2");
+  networkManager.topicPrefixChanged();
+  ota.run();
+  {
+    WiFiClient socket;
+    PubSubClient sender(socket);
+    sender.connect("prefix-sender", "", "");
+    sender.publish("bench2/ota/abort", "");
+  }
+  networkManager.run();
+  check(ota.getState() == MqttOta<>::StateIdle, "OTA topics follow the topic prefix");
+  strcpy(settings.mqttClientName, "bench");
+  networkManager.topicPrefixChanged();
+  ota.run();
+
+  /* an idle link is probed, probes stay out of the statistics */
+  unsigned long probes = networkManager.getLinkHealth().numProbes();
+  unsigned long published = networkManager.getStats().numPublished;
+  unsigned long received = networkManager.getStats().numReceived;
+  for (unsigned long t = 0; t < 60 * 1000UL; t += StepMs) {
+    networkManager.run();
+    simAdvance(StepMs);
+  }
+  check(networkManager.getLinkHealth().numProbes() > probes, "idle link probed");
+  check(networkManager.getStats().numPublished == published and
+        networkManager.getStats().numReceived == received,
+        "probes not counted as messages");
+
+  /* idle telnet: a server enabled in flash stays up, one requested only is
+   * closed
+   */
+  networkManager.setLocalServices(true);
+  bool telnetUp = true;
+  for (unsigned long t = 0; t < 11 * 60 * 1000UL; t += StepMs) {
+    networkManager.run();
+    telnetUp = telnetUp and networkManager.telnetRunning();
+    simAdvance(StepMs);
+  }
+  check(telnetUp, "telnet server enabled in flash kept up while idle");
+  settings.telnetEnabled = false;
+  networkManager.requestTelnet();
+  networkManager.run();
+  check(networkManager.telnetRunning(), "telnet server started on request");
+  for (unsigned long t = 0; t < 11 * 60 * 1000UL; t += StepMs) {
+    networkManager.run();
+    simAdvance(StepMs);
+  }
+  check(not networkManager.telnetRunning(), "requested telnet server closed when idle");
+  settings.telnetEnabled = true;
+  networkManager.setLocalServices(false);
+  networkManager.run();
+
+  SimBroker &broker = SimBroker::instance();
+
+  /* broker restart, the first two connects are refused */
+  unsigned long connects = broker.numConnects();
+  broker.dropSessions();
+  broker.refuseConnects(2);
+  unsigned long ms = runUntilConnected(networkManager, StepMs, TimeoutMs);
+  check(ms, "reconnect after broker restart");
+  reportFault(out, "broker_restart", ms, broker.numConnects() - connects);
+
+  /* WiFi outage of a minute, a filtered value must not report success
+   * while it can not be sent
+   */
+  networkManager.setPublishFilter("bench/temp", DeadbandAbsolute, 0.5f);
+  check(networkManager.publishValue("bench/temp", 21.0f), "filtered value sent");
+  connects = broker.numConnects();
+  WiFi.simSetLinkUp(false);
+  for (unsigned long t = 0; t < 60 * 1000UL; t += StepMs) {
+    networkManager.run();
+    simAdvance(StepMs);
+  }
+  check(not networkManager.publishValue("bench/temp", 21.1f), "value within deadband fails while offline");
+  WiFi.simSetLinkUp(true);
+  ms = runUntilConnected(networkManager, StepMs, TimeoutMs);
+  check(ms, "reconnect after WiFi outage");
+  reportFault(out, "wifi_outage", ms, broker.numConnects() - connects);
+
+  benchDutyCycle(out, log, settings);
+
+  return s_failures ? 1 : 0;
+}
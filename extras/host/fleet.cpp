@@ -0,0 +1,255 @@
+/* Host fleet driver, see README.md.
+ *
+ * Runs many NetworkManager instances in one process against the simulated
+ * broker. Each device has its own link, settings and publish schedule.
+ * Reports the connect rate, publish throughput and publish latency
+ * percentiles as "bench,..." CSV lines on stdout. Exits non-zero if a
+ * device fails to connect or to publish.
+ *
+ *   host_fleet [devices] [simulated seconds]
+ */
+
+#include <MqttClient.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+/** A device's own link. Joins right away, the broker is reached through
+ * the simulated network.
+ */
+class SimLink
+  : public NetworkInterface
+{
+public:
+  SimLink()
+    : m_connected(false)
+  { }
+
+  void
+  begin(const char *, const char *, bool, const char *) override
+  {
+    m_connected = true;
+  }
+
+  void
+  end() override
+  {
+    m_connected = false;
+  }
+
+  bool
+  connected() override
+  {
+    return m_connected;
+  }
+
+  int32_t
+  rssi() override
+  {
+    return -60;
+  }
+
+  bool
+  startMdns(const char *) override
+  {
+    return true;
+  }
+
+  Client &
+  mqttTransport() override
+  {
+    return m_socket;
+  }
+
+private:
+  bool m_connected;
+  WiFiClient m_socket;
+};
+
+/** Writes to a file, e.g. stdout */
+class FilePrint
+  : public Print
+{
+public:
+  FilePrint(FILE *file)
+    : m_file(file)
+  { }
+
+  size_t
+  write(uint8_t c) override
+  {
+    return fwrite(&c, 1, 1, m_file);
+  }
+
+  size_t
+  write(const uint8_t *buffer, size_t size) override
+  {
+    return fwrite(buffer, 1, size, m_file);
+  }
+
+  int
+  availableForWrite() override
+  {
+    return 1024;
+  }
+
+private:
+  FILE *m_file;
+};
+
+struct Device
+{
+  FlashDataMqttClient settings;
+  SimLink link;
+  std::unique_ptr<NetworkManager> networkManager;
+  char topic[MaxMqttClientNameLen + 1 + 5];
+  unsigned long periodMs;
+  unsigned long nextPublishMs;
+  unsigned long numFailed;
+};
+
+static unsigned long
+percentile(std::vector<unsigned long> &values, unsigned p)
+{
+  if (values.empty()) {
+    return 0;
+  }
+  size_t i = (values.size() - 1) * p / 100;
+  std::nth_element(values.begin(), values.begin() + i, values.end());
+  return values[i];
+}
+
+static uint64_t
+hostNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void
+report(Print &out, const char *name, unsigned long iterations, uint64_t totalNs, uint64_t nsPerOp, long extra)
+{
+  out << "bench," << name << "," << iterations << "," << static_cast<unsigned long>(totalNs / 1000) << ","
+      << static_cast<unsigned long>(nsPerOp) << "," << extra << "\n";
+}
+
+int
+main(int argc, char **argv)
+{
+  static const unsigned long StepMs = 100;
+  static const unsigned long ConnectTimeoutMs = 5 * 60 * 1000UL;
+
+  unsigned long numDevices = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000;
+  unsigned long durationS = argc > 2 ? strtoul(argv[2], nullptr, 10) : 60;
+
+  FilePrint out(stdout);
+  FilePrint log(stderr);
+  int failures = 0;
+
+  /* the simulated broker only accepts connects while the simulated network
+   * is up, the devices' own links do not touch it
+   */
+  WiFi.begin("sim", "simsimsim");
+
+  std::vector<std::unique_ptr<Device>> fleet;
+  for (unsigned long i = 0; i < numDevices; i++) {
+    Device *d = new Device;
+    fleet.emplace_back(d);
+    strcpy(d->settings.wifiSsid, "sim");
+    strcpy(d->settings.wifiPass, "simsimsim");
+    strcpy(d->settings.mqttServer, "broker.sim");
+    snprintf(d->settings.mqttClientName, sizeof(d->settings.mqttClientName), "dev%05lu", i);
+    snprintf(d->topic, sizeof(d->topic), "%s/temp", d->settings.mqttClientName);
+    d->periodMs = 5000 + (i % 10) * 1000;
+    d->nextPublishMs = (i * 97) % d->periodMs;
+    d->numFailed = 0;
+
+    /* all instances share the logger and the stall record, see
+     * NetworkManager. Device 0 logs, the others neither log nor watch.
+     */
+    d->networkManager.reset(new NetworkManager(log, d->settings, d->link, nullptr, 0));
+    d->networkManager->setLocalServices(false);
+    if (i) {
+      d->networkManager->setLogSink(false);
+      d->networkManager->getWatchdog().setBudget(0);
+    }
+    d->networkManager->begin();
+  }
+  /* begin() sets the level of the shared logger, keep a thousand connect
+   * messages off the console
+   */
+  logger().setLevel(LogLevelWarn);
+
+  Benchmark(out).header();
+
+  /* connect */
+  unsigned long connects = SimBroker::instance().numConnects();
+  unsigned long elapsedMs = 0;
+  unsigned long numConnected = 0;
+  uint64_t start = hostNs();
+  while (numConnected < numDevices and elapsedMs < ConnectTimeoutMs) {
+    numConnected = 0;
+    for (auto &d : fleet) {
+      d->networkManager->run();
+      numConnected += d->networkManager->getMqttClient().connected();
+    }
+    simAdvance(StepMs);
+    elapsedMs += StepMs;
+  }
+  uint64_t ns = hostNs() - start;
+  connects = SimBroker::instance().numConnects() - connects;
+  /* extra: simulated ms until all devices were connected */
+  report(out, "fleet.connect", connects, ns, connects ? ns / connects : 0, elapsedMs);
+  if (numConnected < numDevices) {
+    fprintf(stderr, "FAIL: %lu of %lu devices connected\n", numConnected, numDevices);
+    failures++;
+  }
+
+  /* publish on each device's schedule */
+  std::vector<unsigned long> latencyNs;
+  unsigned long messages = SimBroker::instance().numMessages();
+  uint64_t publishNs = 0;
+  start = hostNs();
+  for (elapsedMs = 0; elapsedMs < durationS * 1000UL; elapsedMs += StepMs) {
+    for (auto &d : fleet) {
+      d->networkManager->run();
+      if (elapsedMs < d->nextPublishMs) {
+        continue;
+      }
+      d->nextPublishMs += d->periodMs;
+      char payload[16];
+      snprintf(payload, sizeof(payload), "%lu", elapsedMs);
+      uint64_t t = hostNs();
+      bool ok = d->networkManager->publish(d->topic, payload);
+      t = hostNs() - t;
+      publishNs += t;
+      latencyNs.push_back(t);
+      d->numFailed += not ok;
+    }
+    simAdvance(StepMs);
+  }
+  ns = hostNs() - start;
+  messages = SimBroker::instance().numMessages() - messages;
+  unsigned long numPublished = latencyNs.size();
+
+  /* extra: messages routed by the broker including link probes */
+  report(out, "fleet.publish", numPublished, ns, numPublished ? publishNs / numPublished : 0, messages);
+  static const unsigned Percentiles[] = { 50, 90, 99 };
+  for (unsigned p : Percentiles) {
+    char name[32];
+    snprintf(name, sizeof(name), "fleet.publish.p%u", p);
+    report(out, name, numPublished, publishNs, percentile(latencyNs, p), numDevices);
+  }
+
+  unsigned long numFailed = 0;
+  for (auto &d : fleet) {
+    numFailed += d->numFailed;
+  }
+  if (numFailed or numPublished < numDevices * (durationS / 10)) {
+    fprintf(stderr, "FAIL: %lu of %lu messages failed\n", numFailed, numPublished);
+    failures++;
+  }
+
+  return failures ? 1 : 0;
+}
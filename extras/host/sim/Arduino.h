@@ -0,0 +1,161 @@
+#pragma once
+
+/* Simulated Arduino core for host builds, see ../README.md.
+ *
+ * Only what this library uses is provided. The clock is the host's
+ * monotonic clock plus a simulated offset, which simAdvance() and delay()
+ * move forward, so retry delays pass without sleeping.
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <functional>
+#include <new>
+#include <string>
+
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+/** Move the simulated clock forward */
+void simAdvance(unsigned long ms);
+
+/** Start the clock over at 0 as after a reset or a deep sleep wake up. RTC
+ * user memory is kept.
+ */
+void simReset();
+
+/** Call hook from ESP.deepSleep() and return instead of ending the process,
+ * nullptr restores the default
+ */
+void simSetDeepSleepHook(std::function<void(uint64_t us)> hook);
+
+class String
+{
+public:
+  String(const char *s = "")
+    : m_s(s ? s : "")
+  { }
+
+  const char *
+  c_str() const
+  {
+    return m_s.c_str();
+  }
+
+  size_t
+  length() const
+  {
+    return m_s.size();
+  }
+
+private:
+  std::string m_s;
+};
+
+class IPAddress;
+
+class Print
+{
+public:
+  virtual ~Print() { }
+
+  virtual size_t write(uint8_t c) = 0;
+
+  virtual size_t
+  write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size--) {
+      n += write(*buffer++);
+    }
+    return n;
+  }
+
+  size_t
+  write(const char *s)
+  {
+    return s ? write(reinterpret_cast<const uint8_t *>(s), strlen(s)) : 0;
+  }
+
+  virtual int
+  availableForWrite()
+  {
+    return 0;
+  }
+
+  virtual void flush() { }
+
+  size_t print(const char *s) { return write(s); }
+  size_t print(const String &s) { return write(s.c_str()); }
+  size_t print(char c) { return write(static_cast<uint8_t>(c)); }
+  size_t print(int v, int base = 10) { return print(static_cast<long>(v), base); }
+  size_t print(unsigned int v, int base = 10) { return print(static_cast<unsigned long>(v), base); }
+  size_t print(long v, int base = 10);
+  size_t print(unsigned long v, int base = 10);
+  size_t print(double v, int digits = 2);
+  size_t print(const IPAddress &ip);
+
+  size_t println(const char *s = "") { return print(s) + print("\r\n"); }
+
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream
+  : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+class IPAddress
+{
+public:
+  IPAddress(uint32_t address = 0)
+    : m_address(address)
+  { }
+
+  operator uint32_t() const
+  {
+    return m_address;
+  }
+
+  String toString() const;
+
+private:
+  uint32_t m_address;
+};
+
+class Client
+  : public Stream
+{
+public:
+  virtual int connect(const char *host, uint16_t port) = 0;
+  virtual uint8_t connected() = 0;
+  virtual void stop() = 0;
+};
+
+/** ESP8266 system functions. RTC user memory is kept in RAM, restart() and
+ * deepSleep() end the process (see simSetDeepSleepHook()).
+ */
+class EspClass
+{
+public:
+  void restart();
+  void deepSleep(uint64_t us);
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+};
+
+extern EspClass ESP;
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <Arduino.h>
+
+typedef enum
+{
+  WL_IDLE_STATUS,
+  WL_CONNECTED,
+  WL_DISCONNECTED,
+} wl_status_t;
+
+typedef enum
+{
+  WIFI_OFF,
+  WIFI_STA,
+} WiFiMode_t;
+
+/** Simulated WiFi station.
+ *
+ * A single access point "sim" is visible. begin() joins it right away
+ * unless simSetLinkUp(false) took the link down, which also drops an
+ * established connection.
+ */
+class WiFiClass
+{
+public:
+  WiFiClass();
+
+  bool mode(WiFiMode_t mode);
+  bool hostname(const char *name);
+  String hostname();
+  int begin(const char *ssid, const char *pass, int32_t channel = 0, const uint8_t *bssid = nullptr, bool connect = true);
+  bool disconnect(bool wifiOff = false);
+  wl_status_t status();
+
+  int32_t RSSI();
+  int32_t RSSI(uint8_t i);
+  String SSID();
+  String SSID(uint8_t i);
+  uint8_t *BSSID();
+  uint8_t *BSSID(uint8_t i);
+  String BSSIDstr();
+  String BSSIDstr(uint8_t i);
+  int32_t channel();
+  int32_t channel(uint8_t i);
+  IPAddress localIP();
+  uint8_t *macAddress(uint8_t *mac);
+  int8_t scanNetworks();
+
+  /** Fault injection: take the link down or bring it back */
+  void simSetLinkUp(bool up);
+
+  /** Number of successful joins */
+  unsigned long simNumJoins() const;
+
+private:
+  bool m_linkUp;
+  bool m_joined;
+  unsigned long m_numJoins;
+  char m_hostName[64];
+  uint8_t m_bssid[6];
+};
+
+extern WiFiClass WiFi;
+
+/** Socket stand-in. The simulated PubSubClient talks to the simulated
+ * broker directly, so this one never carries data.
+ */
+class WiFiClient
+  : public Client
+{
+public:
+  int connect(const char *host, uint16_t port) override { return 0; }
+  uint8_t connected() override { return 0; }
+  void stop() override { }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  size_t write(uint8_t c) override { return 0; }
+  using Print::write;
+};
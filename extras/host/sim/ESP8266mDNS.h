@@ -0,0 +1,14 @@
+#pragma once
+
+#include <Arduino.h>
+
+/** mDNS responder stand-in, announces nothing */
+class MDNSResponder
+{
+public:
+  bool begin(const char *hostName) { return true; }
+  void addService(const char *service, const char *proto, uint16_t port) { }
+  void end() { }
+};
+
+extern MDNSResponder MDNS;
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <Arduino.h>
+
+struct FlashDataBase
+{ };
+
+/** Settings persisted to a simulated flash.
+ *
+ * Like on the device, update() compares the settings with the stored copy
+ * and only writes if something changed.
+ */
+template <class FlashData>
+class FlashSettings
+  : public FlashData
+{
+public:
+  FlashSettings()
+    : m_numWrites(0)
+  {
+    memcpy(&m_flash, static_cast<FlashData *>(this), sizeof(FlashData));
+  }
+
+  void
+  begin()
+  {
+    memcpy(static_cast<FlashData *>(this), &m_flash, sizeof(FlashData));
+  }
+
+  void
+  update()
+  {
+    if (memcmp(&m_flash, static_cast<FlashData *>(this), sizeof(FlashData)) != 0) {
+      memcpy(&m_flash, static_cast<FlashData *>(this), sizeof(FlashData));
+      m_numWrites++;
+    }
+  }
+
+  unsigned long
+  simNumWrites() const
+  {
+    return m_numWrites;
+  }
+
+private:
+  FlashData m_flash;
+  unsigned long m_numWrites;
+};
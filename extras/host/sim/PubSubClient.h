@@ -0,0 +1,101 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#define MQTT_MAX_HEADER_SIZE 5
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char *, uint8_t *, unsigned int)> callback
+
+class PubSubClient;
+
+/** In-process MQTT broker the simulated clients connect to.
+ *
+ * QoS 0 only. Messages are queued per client and delivered from the
+ * client's loop(), retained messages are delivered on subscribe. Faults
+ * can be scripted: refuse the next connects, drop all sessions.
+ */
+class SimBroker
+{
+public:
+  static SimBroker &instance();
+
+  /** Fault injection: refuse the next count connects */
+  void refuseConnects(unsigned count);
+
+  /** Fault injection: drop all sessions as if the broker restarted */
+  void dropSessions();
+
+  unsigned long numConnects() const { return m_numConnects; }
+  unsigned long numMessages() const { return m_numMessages; }
+
+  /* called by the clients */
+  bool connect(PubSubClient *client);
+  void disconnect(PubSubClient *client);
+  void publish(const std::string &topic, const std::string &payload, bool retained);
+  void deliverRetained(PubSubClient *client, const std::string &filter);
+
+  static bool matches(const char *filter, const char *topic);
+
+private:
+  SimBroker();
+
+  std::vector<PubSubClient *> m_clients;
+  std::map<std::string, std::string> m_retained;
+  unsigned m_refuse;
+  unsigned long m_numConnects;
+  unsigned long m_numMessages;
+};
+
+/** PubSubClient with the API this library uses, connected to the SimBroker */
+class PubSubClient
+  : public Print
+{
+public:
+  PubSubClient(Client &client);
+  ~PubSubClient();
+
+  PubSubClient &setServer(const char *domain, uint16_t port);
+  PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE);
+  PubSubClient &setKeepAlive(uint16_t keepAlive);
+  PubSubClient &setSocketTimeout(uint16_t timeout);
+  bool setBufferSize(uint16_t size);
+  uint16_t getBufferSize();
+
+  bool connect(const char *id, const char *user, const char *pass);
+  void disconnect();
+  bool connected();
+  int state();
+
+  bool publish(const char *topic, const char *payload, bool retained = false);
+  bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained = false);
+  bool beginPublish(const char *topic, unsigned int length, bool retained);
+  int endPublish();
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+
+  bool subscribe(const char *topic, uint8_t qos = 0);
+  bool unsubscribe(const char *topic);
+  bool loop();
+
+  /* called by the broker */
+  bool simSubscribed(const char *topic) const;
+  void simQueue(const std::string &topic, const std::string &payload);
+  void simDrop();
+
+private:
+  std::function<void(char *, uint8_t *, unsigned int)> m_callback;
+  std::vector<uint8_t> m_buffer;
+  bool m_connected;
+  int m_state;
+  std::vector<std::string> m_filters;
+  std::deque<std::pair<std::string, std::string>> m_inbox;
+
+  /* streamed publish in progress */
+  std::string m_streamTopic;
+  std::string m_streamPayload;
+  bool m_streamRetained;
+};
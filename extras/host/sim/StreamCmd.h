@@ -0,0 +1,189 @@
+#pragma once
+
+#include <Arduino.h>
+
+/* Streaming style output as provided on the device */
+template <typename T>
+inline Print &
+operator<<(Print &print, T arg)
+{
+  print.print(arg);
+  return print;
+}
+
+/** Command line interpreter stand-in.
+ *
+ * Reads lines from a stream, looks up the first word in the command table
+ * and calls its handler. Handlers fetch arguments with next() or getOpt().
+ * Only the single command set this library uses is supported.
+ */
+template <size_t _NumCommandSets,
+          size_t _MaxCommands,
+          size_t _CommandBufferSize,
+          size_t _MaxCommandSize>
+class StreamCmd
+{
+public:
+  typedef enum
+  {
+    ArgOk,
+    ArgNone,
+    ArgInvalid,
+    ArgTooSmall,
+    ArgTooBig,
+    ArgNoMatch,
+  } ArgResult;
+
+  StreamCmd(Stream &stream, char eolChar, const char *prompt)
+    : m_stream(stream)
+    , m_eolChar(eolChar)
+    , m_prompt(prompt)
+    , m_numCommands(0)
+    , m_defaultHandler(nullptr)
+    , m_len(0)
+    , m_lineLen(0)
+    , m_save(nullptr)
+    , m_current(nullptr)
+  { }
+
+  void
+  run()
+  {
+    while (m_stream.available() > 0) {
+      char c = m_stream.read();
+      if (c == m_eolChar) {
+        m_buffer[m_len] = 0;
+        m_lineLen = m_len;
+        m_len = 0;
+        dispatch();
+        if (m_prompt) {
+          m_stream.print(m_prompt);
+        }
+        continue;
+      }
+      if (c != '\r' and m_len < _CommandBufferSize - 1) {
+        m_buffer[m_len++] = c;
+      }
+    }
+  }
+
+  void
+  clearBuffer()
+  {
+    m_len = 0;
+  }
+
+protected:
+  typedef void (StreamCmd::*Handler)();
+  typedef void (StreamCmd::*DefaultHandler)(const char *);
+
+  template <class T>
+  void
+  addCommand(const char *command, void (T::*handler)())
+  {
+    if (m_numCommands < _MaxCommands) {
+      m_commands[m_numCommands].name = command;
+      m_commands[m_numCommands].handler = static_cast<Handler>(handler);
+      m_numCommands++;
+    }
+  }
+
+  template <class T>
+  void
+  setDefaultHandler(void (T::*handler)(const char *))
+  {
+    m_defaultHandler = static_cast<DefaultHandler>(handler);
+  }
+
+  Stream &
+  stream()
+  {
+    return m_stream;
+  }
+
+  /** Next argument of the current command, nullptr if there is none */
+  char *
+  next()
+  {
+    char *token = strtok_r(nullptr, " ", &m_save);
+    if (token) {
+      m_current = token;
+    }
+    return token;
+  }
+
+  /** The last token read, the command name inside a handler */
+  const char *
+  current()
+  {
+    return m_current;
+  }
+
+  /** Undo the tokenization of the remainder of the line */
+  void
+  reset()
+  {
+    for (size_t i = 0; i < m_lineLen; i++) {
+      if (m_buffer[i] == 0) {
+        m_buffer[i] = ' ';
+      }
+    }
+  }
+
+  template <typename... Options>
+  ArgResult
+  getOpt(size_t &idx, Options... options)
+  {
+    const char *arg = next();
+    if (not arg) {
+      return ArgNone;
+    }
+    const char *opts[] = {options...};
+    for (size_t i = 0; i < sizeof...(options); i++) {
+      if (strcmp(arg, opts[i]) == 0) {
+        idx = i;
+        return ArgOk;
+      }
+    }
+    return ArgNoMatch;
+  }
+
+private:
+  struct Command
+  {
+    const char *name;
+    Handler handler;
+  };
+
+  void
+  dispatch()
+  {
+    m_current = strtok_r(m_buffer, " ", &m_save);
+    if (not m_current) {
+      return;
+    }
+    for (size_t i = 0; i < m_numCommands; i++) {
+      if (strcmp(m_current, m_commands[i].name) == 0) {
+        (this->*m_commands[i].handler)();
+        return;
+      }
+    }
+    if (m_defaultHandler) {
+      (this->*m_defaultHandler)(m_current);
+    }
+  }
+
+  Stream &m_stream;
+  char m_eolChar;
+  const char *m_prompt;
+
+  Command m_commands[_MaxCommands];
+  size_t m_numCommands;
+  DefaultHandler m_defaultHandler;
+
+  char m_buffer[_CommandBufferSize];
+  size_t m_len;
+  size_t m_lineLen;
+  char *m_save;
+  const char *m_current;
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+
+/** Telnet session stand-in, no one ever logs in */
+class TelnetClient
+  : public Stream
+{
+public:
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  size_t write(uint8_t c) override { return 1; }
+  using Print::write;
+
+  void stop() { }
+};
+
+class TelnetServer
+{
+public:
+  TelnetServer(TelnetClient *clients, size_t numClients) { }
+  void run() { }
+};
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <Arduino.h>
+
+/** Ticker stand-in. There are no timer interrupts on the host, callbacks
+ * are never invoked, so the stall watchdog does not fire.
+ */
+class Ticker
+{
+public:
+  template <typename T>
+  void attach_ms(uint32_t ms, void (*callback)(T), T arg) { }
+
+  void detach() { }
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Arduino.h>
+
+/** Updater stand-in for UpdateOtaWriter. Accepts the image, but stores
+ * nothing and verifies nothing. Use FakeOtaWriter (../FakeOtaWriter.h) to
+ * look at what was written.
+ */
+class UpdaterClass
+{
+public:
+  UpdaterClass()
+    : m_size(0)
+    , m_progress(0)
+    , m_running(false)
+  { }
+
+  bool
+  begin(size_t size)
+  {
+    m_size = size;
+    m_progress = 0;
+    m_running = true;
+    return true;
+  }
+
+  bool setMD5(const char *md5) { return strlen(md5) == 32; }
+
+  size_t
+  write(uint8_t *data, size_t len)
+  {
+    (void)data;
+    m_progress += len;
+    return len;
+  }
+
+  bool
+  end(bool evenIfRemaining = false)
+  {
+    bool ok = m_running and (evenIfRemaining or m_progress == m_size);
+    m_running = false;
+    return ok;
+  }
+
+  size_t progress() { return m_progress; }
+  bool isRunning() { return m_running; }
+
+private:
+  size_t m_size;
+  size_t m_progress;
+  bool m_running;
+};
+
+extern UpdaterClass Update;
@@ -0,0 +1,558 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266mDNS.h>
+#include <PubSubClient.h>
+#include <Updater.h>
+
+#include <algorithm>
+#include <chrono>
+
+/* clock */
+
+static int64_t s_offsetUs = 0;
+static std::function<void(uint64_t us)> s_deepSleepHook;
+
+static uint64_t
+hostMicros()
+{
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+unsigned long
+micros()
+{
+  return static_cast<unsigned long>(hostMicros() + s_offsetUs);
+}
+
+unsigned long
+millis()
+{
+  return static_cast<unsigned long>((hostMicros() + s_offsetUs) / 1000);
+}
+
+void
+simAdvance(unsigned long ms)
+{
+  s_offsetUs += ms * 1000UL;
+}
+
+void
+simReset()
+{
+  s_offsetUs = -static_cast<int64_t>(hostMicros());
+}
+
+void
+simSetDeepSleepHook(std::function<void(uint64_t us)> hook)
+{
+  s_deepSleepHook = hook;
+}
+
+void
+delay(unsigned long ms)
+{
+  simAdvance(ms);
+}
+
+void
+yield()
+{ }
+
+/* Print */
+
+size_t
+Print::print(long v, int base)
+{
+  char buf[24];
+  if (base == 16) {
+    snprintf(buf, sizeof(buf), "%lx", v);
+  } else {
+    snprintf(buf, sizeof(buf), "%ld", v);
+  }
+  return write(buf);
+}
+
+size_t
+Print::print(unsigned long v, int base)
+{
+  char buf[24];
+  snprintf(buf, sizeof(buf), base == 16 ? "%lx" : "%lu", v);
+  return write(buf);
+}
+
+size_t
+Print::print(double v, int digits)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.*f", digits, v);
+  return write(buf);
+}
+
+size_t
+Print::print(const IPAddress &ip)
+{
+  return write(ip.toString().c_str());
+}
+
+size_t
+Print::printf(const char *format, ...)
+{
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  return n > 0 ? write(reinterpret_cast<const uint8_t *>(buf), std::min<size_t>(n, sizeof(buf) - 1)) : 0;
+}
+
+String
+IPAddress::toString() const
+{
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%u.%u.%u.%u",
+           m_address & 0xff, (m_address >> 8) & 0xff, (m_address >> 16) & 0xff, m_address >> 24);
+  return String(buf);
+}
+
+/* ESP */
+
+EspClass ESP;
+
+static uint32_t s_rtcMemory[128];
+
+void
+EspClass::restart()
+{
+  printf("sim: restart\n");
+  exit(0);
+}
+
+void
+EspClass::deepSleep(uint64_t us)
+{
+  if (s_deepSleepHook) {
+    s_deepSleepHook(us);
+    return;
+  }
+  printf("sim: deep sleep %llu us\n", static_cast<unsigned long long>(us));
+  exit(0);
+}
+
+bool
+EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size)
+{
+  if (offset * 4 + size > sizeof(s_rtcMemory)) {
+    return false;
+  }
+  memcpy(data, s_rtcMemory + offset, size);
+  return true;
+}
+
+bool
+EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size)
+{
+  if (offset * 4 + size > sizeof(s_rtcMemory)) {
+    return false;
+  }
+  memcpy(s_rtcMemory + offset, data, size);
+  return true;
+}
+
+/* Update */
+
+UpdaterClass Update;
+
+/* WiFi */
+
+WiFiClass WiFi;
+MDNSResponder MDNS;
+
+WiFiClass::WiFiClass()
+  : m_linkUp(true)
+  , m_joined(false)
+  , m_numJoins(0)
+  , m_hostName{"sim"}
+  , m_bssid{0x02, 0x00, 0x00, 0x00, 0x00, 0x01}
+{ }
+
+bool
+WiFiClass::mode(WiFiMode_t mode)
+{
+  return true;
+}
+
+bool
+WiFiClass::hostname(const char *name)
+{
+  snprintf(m_hostName, sizeof(m_hostName), "%s", name);
+  return true;
+}
+
+String
+WiFiClass::hostname()
+{
+  return String(m_hostName);
+}
+
+int
+WiFiClass::begin(const char *ssid, const char *pass, int32_t channel, const uint8_t *bssid, bool connect)
+{
+  m_joined = m_linkUp;
+  m_numJoins += m_joined;
+  return status();
+}
+
+bool
+WiFiClass::disconnect(bool wifiOff)
+{
+  m_joined = false;
+  return true;
+}
+
+wl_status_t
+WiFiClass::status()
+{
+  return m_joined ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+int32_t WiFiClass::RSSI() { return -55; }
+int32_t WiFiClass::RSSI(uint8_t i) { return -55; }
+String WiFiClass::SSID() { return String("sim"); }
+String WiFiClass::SSID(uint8_t i) { return String("sim"); }
+uint8_t *WiFiClass::BSSID() { return m_bssid; }
+uint8_t *WiFiClass::BSSID(uint8_t i) { return m_bssid; }
+String WiFiClass::BSSIDstr() { return String("02:00:00:00:00:01"); }
+String WiFiClass::BSSIDstr(uint8_t i) { return String("02:00:00:00:00:01"); }
+int32_t WiFiClass::channel() { return 1; }
+int32_t WiFiClass::channel(uint8_t i) { return 1; }
+IPAddress WiFiClass::localIP() { return IPAddress(m_joined ? 0x0100007f : 0); }
+int8_t WiFiClass::scanNetworks() { return m_linkUp ? 1 : 0; }
+
+uint8_t *
+WiFiClass::macAddress(uint8_t *mac)
+{
+  static const uint8_t Mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+  memcpy(mac, Mac, sizeof(Mac));
+  return mac;
+}
+
+void
+WiFiClass::simSetLinkUp(bool up)
+{
+  m_linkUp = up;
+  if (not up) {
+    m_joined = false;
+    SimBroker::instance().dropSessions();
+  }
+}
+
+unsigned long
+WiFiClass::simNumJoins() const
+{
+  return m_numJoins;
+}
+
+/* broker */
+
+SimBroker &
+SimBroker::instance()
+{
+  static SimBroker broker;
+  return broker;
+}
+
+SimBroker::SimBroker()
+  : m_refuse(0)
+  , m_numConnects(0)
+  , m_numMessages(0)
+{ }
+
+void
+SimBroker::refuseConnects(unsigned count)
+{
+  m_refuse = count;
+}
+
+void
+SimBroker::dropSessions()
+{
+  std::vector<PubSubClient *> clients;
+  clients.swap(m_clients);
+  for (PubSubClient *c : clients) {
+    c->simDrop();
+  }
+}
+
+bool
+SimBroker::connect(PubSubClient *client)
+{
+  if (m_refuse) {
+    m_refuse--;
+    return false;
+  }
+  if (WiFi.status() != WL_CONNECTED) {
+    return false;
+  }
+  m_clients.push_back(client);
+  m_numConnects++;
+  return true;
+}
+
+void
+SimBroker::disconnect(PubSubClient *client)
+{
+  m_clients.erase(std::remove(m_clients.begin(), m_clients.end(), client), m_clients.end());
+}
+
+void
+SimBroker::publish(const std::string &topic, const std::string &payload, bool retained)
+{
+  m_numMessages++;
+  if (retained) {
+    if (payload.empty()) {
+      m_retained.erase(topic);
+    } else {
+      m_retained[topic] = payload;
+    }
+  }
+  for (PubSubClient *c : m_clients) {
+    if (c->simSubscribed(topic.c_str())) {
+      c->simQueue(topic, payload);
+    }
+  }
+}
+
+void
+SimBroker::deliverRetained(PubSubClient *client, const std::string &filter)
+{
+  for (const auto &r : m_retained) {
+    if (matches(filter.c_str(), r.first.c_str())) {
+      client->simQueue(r.first, r.second);
+    }
+  }
+}
+
+bool
+SimBroker::matches(const char *filter, const char *topic)
+{
+  while (*filter) {
+    if (*filter == '#') {
+      return true;
+    }
+    if (*filter == '+') {
+      while (*topic and *topic != '/') {
+        topic++;
+      }
+      filter++;
+      continue;
+    }
+    if (*filter != *topic) {
+      /* "a/#" also matches "a" */
+      return *topic == 0 and filter[0] == '/' and filter[1] == '#' and filter[2] == 0;
+    }
+    filter++;
+    topic++;
+  }
+  return *topic == 0;
+}
+
+/* client */
+
+PubSubClient::PubSubClient(Client &client)
+  : m_buffer(256)
+  , m_connected(false)
+  , m_state(-1)
+  , m_streamRetained(false)
+{ }
+
+PubSubClient::~PubSubClient()
+{
+  disconnect();
+}
+
+PubSubClient &PubSubClient::setServer(const char *domain, uint16_t port) { return *this; }
+PubSubClient &PubSubClient::setKeepAlive(uint16_t keepAlive) { return *this; }
+PubSubClient &PubSubClient::setSocketTimeout(uint16_t timeout) { return *this; }
+
+PubSubClient &
+PubSubClient::setCallback(std::function<void(char *, uint8_t *, unsigned int)> callback)
+{
+  m_callback = callback;
+  return *this;
+}
+
+bool
+PubSubClient::setBufferSize(uint16_t size)
+{
+  if (size == 0) {
+    return false;
+  }
+  m_buffer.resize(size);
+  return true;
+}
+
+uint16_t
+PubSubClient::getBufferSize()
+{
+  return m_buffer.size();
+}
+
+bool
+PubSubClient::connect(const char *id, const char *user, const char *pass)
+{
+  disconnect();
+  m_connected = SimBroker::instance().connect(this);
+  m_state = m_connected ? 0 : -2;
+  m_filters.clear();
+  m_inbox.clear();
+  return m_connected;
+}
+
+void
+PubSubClient::disconnect()
+{
+  if (m_connected) {
+    SimBroker::instance().disconnect(this);
+  }
+  m_connected = false;
+  m_state = -1;
+}
+
+bool
+PubSubClient::connected()
+{
+  return m_connected;
+}
+
+int
+PubSubClient::state()
+{
+  return m_state;
+}
+
+bool
+PubSubClient::publish(const char *topic, const char *payload, bool retained)
+{
+  return publish(topic, reinterpret_cast<const uint8_t *>(payload), strlen(payload), retained);
+}
+
+bool
+PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained)
+{
+  if (not m_connected or length + strlen(topic) + MQTT_MAX_HEADER_SIZE + 2 > m_buffer.size()) {
+    return false;
+  }
+  SimBroker::instance().publish(topic, std::string(reinterpret_cast<const char *>(payload), length), retained);
+  return true;
+}
+
+bool
+PubSubClient::beginPublish(const char *topic, unsigned int length, bool retained)
+{
+  if (not m_connected) {
+    return false;
+  }
+  m_streamTopic = topic;
+  m_streamPayload.clear();
+  m_streamRetained = retained;
+  return true;
+}
+
+int
+PubSubClient::endPublish()
+{
+  if (not m_connected) {
+    return 0;
+  }
+  SimBroker::instance().publish(m_streamTopic, m_streamPayload, m_streamRetained);
+  return 1;
+}
+
+size_t
+PubSubClient::write(uint8_t c)
+{
+  m_streamPayload += static_cast<char>(c);
+  return 1;
+}
+
+size_t
+PubSubClient::write(const uint8_t *buffer, size_t size)
+{
+  m_streamPayload.append(reinterpret_cast<const char *>(buffer), size);
+  return size;
+}
+
+bool
+PubSubClient::subscribe(const char *topic, uint8_t qos)
+{
+  if (not m_connected) {
+    return false;
+  }
+  m_filters.push_back(topic);
+  SimBroker::instance().deliverRetained(this, topic);
+  return true;
+}
+
+bool
+PubSubClient::unsubscribe(const char *topic)
+{
+  if (not m_connected) {
+    return false;
+  }
+  m_filters.erase(std::remove(m_filters.begin(), m_filters.end(), std::string(topic)), m_filters.end());
+  return true;
+}
+
+bool
+PubSubClient::loop()
+{
+  /* deliver what is queued now, messages published by handlers wait for
+   * the next loop() as they would on the wire
+   */
+  size_t n = m_inbox.size();
+  while (m_connected and n--) {
+    std::pair<std::string, std::string> msg = m_inbox.front();
+    m_inbox.pop_front();
+
+    /* like the real client, hand out topic and payload in the buffer */
+    size_t topicLen = msg.first.size();
+    if (topicLen + 1 + msg.second.size() > m_buffer.size()) {
+      continue;
+    }
+    char *topic = reinterpret_cast<char *>(m_buffer.data());
+    memcpy(topic, msg.first.data(), topicLen);
+    topic[topicLen] = 0;
+    uint8_t *payload = m_buffer.data() + topicLen + 1;
+    memcpy(payload, msg.second.data(), msg.second.size());
+    if (m_callback) {
+      m_callback(topic, payload, msg.second.size());
+    }
+  }
+  return m_connected;
+}
+
+bool
+PubSubClient::simSubscribed(const char *topic) const
+{
+  for (const std::string &f : m_filters) {
+    if (SimBroker::matches(f.c_str(), topic)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+PubSubClient::simQueue(const std::string &topic, const std::string &payload)
+{
+  m_inbox.emplace_back(topic, payload);
+}
+
+void
+PubSubClient::simDrop()
+{
+  m_connected = false;
+  m_state = -3;
+  m_inbox.clear();
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <MqttNetwork.h>
+#include <MqttCliStream.h>
+
+/** Minimal micro benchmark runner.
+ *
+ * Results are printed as CSV lines, so they can be collected from the serial
+ * console, telnet or the MQTT CLI and compared between firmware builds:
+ *
+ *   bench,<name>,<iterations>,<total us>,<ns per op>,<extra>
+ */
+class Benchmark
+{
+public:
+  Benchmark(Print &out)
+    : m_out(out)
+  { }
+
+  void
+  header()
+  {
+    m_out << "bench,name,iterations,total_us,ns_per_op,extra\n";
+  }
+
+  /** Run fn iterations times and print the result
+   * @param extra Additional figure to report, e.g. a payload size
+   */
+  template <typename F>
+  void
+  run(const char *name, unsigned long iterations, F fn, long extra = 0)
+  {
+    yield();
+    unsigned long start = micros();
+    for (unsigned long i = 0; i < iterations; i++) {
+      fn();
+    }
+    unsigned long us = micros() - start;
+    unsigned long nsPerOp = iterations ? (static_cast<uint64_t>(us) * 1000) / iterations : 0;
+    m_out << "bench," << name << "," << iterations << "," << us << "," << nsPerOp << "," << extra << "\n";
+    yield();
+  }
+
+private:
+  Print &m_out;
+};
+
+/** Benchmarks of the client's hot paths.
+ *
+ * Covers the NetworkManager::run() idle loop, MQTT message dispatch, payload
+ * encoding (text versus CBOR, the extra column is the payload size), the
+ * flash settings update() when nothing changed and command dispatch through
+ * a second CLI of type Cli on an MqttCliStream, the way batches arrive via
+ * MQTT (the extra column is the number of commands per batch).
+ *
+ * If connected, publish throughput against the configured broker (messages
+ * go to "<prefix>/bench") and the time to tear down and reconnect the MQTT
+ * session are measured as well. The publish rate limiter is bypassed
+ * meanwhile. The extra column of the publish.small.sent and
+ * mqtt.reconnect.ok lines is the number of messages actually sent and
+ * reconnects which succeeded.
+ */
+template <class Cli, class FlashSettingsType>
+void
+benchmarkClient(Print &out, NetworkManager &networkManager, FlashSettingsType &flashSettings)
+{
+  /* give up waiting for a reconnect after ... */
+  static const unsigned long ReconnectTimeoutMs = 10000;
+
+  Benchmark bench(out);
+  bench.header();
+
+  PublishRateLimiter &limiter = networkManager.getRateLimiter();
+  bool bypass = limiter.bypass();
+  limiter.setBypass(true);
+
+  bench.run("run.idle", 200, [&]() {
+    networkManager.run();
+  });
+
+  volatile bool matched = false;
+  bench.run("topic.match", 1000, [&]() {
+    matched = NetworkManager::topicMatches("+/sensor/#", "mqtt-client/sensor/temp/0");
+  });
+  (void)matched;
+
+  uint8_t buf[64];
+  size_t size = 0;
+  auto encode = [&](ContentFormat format) {
+    PayloadWriter w(format, buf, sizeof(buf));
+    w.beginObject()
+      .field("t", 21.5f)
+      .field("h", 40)
+      .field("p", 96325UL)
+      .endObject();
+    size = w.size();
+  };
+  encode(ContentFormatText);
+  bench.run("encode.text", 200, [&]() { encode(ContentFormatText); }, size);
+  encode(ContentFormatCbor);
+  bench.run("encode.cbor", 200, [&]() { encode(ContentFormatCbor); }, size);
+
+  bench.run("settings.update", 10, [&]() {
+    flashSettings.update();
+  });
+
+  /* the CLI is allocated here to not keep it around for good */
+  struct BenchCli
+  {
+    BenchCli(NetworkManager &nm, FlashSettingsType &fs)
+      : stream(nm)
+      , cli(stream, fs, nm)
+    { }
+    MqttCliStream<64, 512> stream;
+    Cli cli;
+  };
+  BenchCli *benchCli = new (std::nothrow) BenchCli(networkManager, flashSettings);
+  if (benchCli) {
+    static const char Batch[] = "@bench\nm.port\nm.link\nn.rssi\n";
+    bench.run("cli.dispatch", 20, [&]() {
+      benchCli->stream.feed(Batch, sizeof(Batch) - 1);
+      while (benchCli->stream.busy()) {
+        benchCli->cli.run();
+        benchCli->stream.run();
+      }
+    }, 3);
+    delete benchCli;
+  } else {
+    out << "bench,cli.dispatch,0,0,0,0\n";
+  }
+
+  if (networkManager.getMqttClient().connected()) {
+    char topic[MaxMqttClientNameLen + 1 + 6];
+    snprintf(topic, sizeof(topic), "%s/bench", networkManager.topicPrefix());
+    unsigned long sent = 0;
+    bench.run("publish.small", 100, [&]() {
+      sent += networkManager.publish(topic, "0123456789");
+    });
+    out << "bench,publish.small.sent,100,0,0," << sent << "\n";
+
+    unsigned long reconnected = 0;
+    bench.run("mqtt.reconnect", 3, [&]() {
+      networkManager.reconfigureMqtt();
+      networkManager.run();
+      unsigned long start = millis();
+      while (not networkManager.getMqttClient().connected() and millis() - start < ReconnectTimeoutMs) {
+        networkManager.run();
+        yield();
+      }
+      reconnected += networkManager.getMqttClient().connected();
+    });
+    out << "bench,mqtt.reconnect.ok,3,0,0," << reconnected << "\n";
+  } else {
+    out << "bench,publish.small,0,0,0,0\n";
+    out << "bench,mqtt.reconnect,0,0,0,0\n";
+  }
+
+  limiter.setBypass(bypass);
+}
@@ -0,0 +1,686 @@
+#pragma once
+
+#include <Arduino.h>
+
+/** Destination for encoded payload bytes.
+ *
+ * A sink either writes into a caller supplied buffer, streams into a Print
+ * (e.g. the PubSubClient streaming publish path) or -- when constructed
+ * without arguments -- just counts the bytes. Counting is used to determine
+ * the length of a streamed publish before the actual encoding pass.
+ *
+ * A sink never allocates. If a buffer overflows, the overflow flag is set and
+ * all further bytes are dropped.
+ */
+class PayloadSink
+{
+public:
+  PayloadSink()
+    : m_buffer(nullptr)
+    , m_capacity(0)
+    , m_print(nullptr)
+    , m_size(0)
+    , m_overflow(false)
+  { }
+
+  PayloadSink(uint8_t *buffer, size_t capacity)
+    : m_buffer(buffer)
+    , m_capacity(capacity)
+    , m_print(nullptr)
+    , m_size(0)
+    , m_overflow(false)
+  { }
+
+  PayloadSink(Print &print)
+    : m_buffer(nullptr)
+    , m_capacity(0)
+    , m_print(&print)
+    , m_size(0)
+    , m_overflow(false)
+  { }
+
+  void
+  put(uint8_t b)
+  {
+    if (m_print) {
+      if (m_print->write(b) != 1) {
+        m_overflow = true;
+      }
+    } else if (m_buffer) {
+      if (m_size >= m_capacity) {
+        m_overflow = true;
+        return;
+      }
+      m_buffer[m_size] = b;
+    }
+    m_size++;
+  }
+
+  void
+  put(const uint8_t *data, size_t len)
+  {
+    if (m_print) {
+      if (m_print->write(data, len) != len) {
+        m_overflow = true;
+      }
+    } else if (m_buffer) {
+      if (m_size + len > m_capacity) {
+        m_overflow = true;
+        return;
+      }
+      memcpy(m_buffer + m_size, data, len);
+    }
+    m_size += len;
+  }
+
+  void
+  reset()
+  {
+    m_size = 0;
+    m_overflow = false;
+  }
+
+  /** Mark the payload as incomplete, e.g. if a value could not be encoded */
+  void
+  setOverflow()
+  {
+    m_overflow = true;
+  }
+
+  /** Encoded data. Only valid for buffer backed sinks. */
+  const uint8_t *
+  data() const
+  {
+    return m_buffer;
+  }
+
+  size_t
+  size() const
+  {
+    return m_size;
+  }
+
+  bool
+  overflow() const
+  {
+    return m_overflow;
+  }
+
+private:
+  uint8_t *m_buffer;
+  size_t m_capacity;
+  Print *m_print;
+  size_t m_size;
+  bool m_overflow;
+};
+
+/** Zero-allocation CBOR (RFC 7049) encoder.
+ *
+ * Writes directly into a PayloadSink. Integers are always written in their
+ * shortest form, floats as IEEE 754 single precision.
+ *
+ * Example:
+ *
+ *   uint8_t buf[32];
+ *   CborWriter w(buf, sizeof(buf));
+ *   w.beginMap(2);
+ *   w.writeString("t"); w.writeFloat(21.5);
+ *   w.writeString("h"); w.writeUint(40);
+ *   networkManager.publish("sensor/env", w.data(), w.size());
+ */
+class CborWriter
+{
+public:
+  enum
+  {
+    MajorUint   = 0,
+    MajorNegInt = 1,
+    MajorBytes  = 2,
+    MajorString = 3,
+    MajorArray  = 4,
+    MajorMap    = 5,
+    MajorTag    = 6,
+    MajorSimple = 7,
+  };
+
+  CborWriter()
+  { }
+
+  CborWriter(uint8_t *buffer, size_t capacity)
+    : m_sink(buffer, capacity)
+  { }
+
+  CborWriter(Print &print)
+    : m_sink(print)
+  { }
+
+  CborWriter &
+  writeUint(uint32_t value)
+  {
+    writeHead(MajorUint, value);
+    return *this;
+  }
+
+  CborWriter &
+  writeInt(int32_t value)
+  {
+    if (value < 0) {
+      /* -1 - n without signed overflow for INT32_MIN */
+      writeHead(MajorNegInt, static_cast<uint32_t>(-(value + 1)));
+    } else {
+      writeHead(MajorUint, static_cast<uint32_t>(value));
+    }
+    return *this;
+  }
+
+  CborWriter &
+  writeBool(bool value)
+  {
+    m_sink.put(value ? 0xf5 : 0xf4);
+    return *this;
+  }
+
+  CborWriter &
+  writeNull()
+  {
+    m_sink.put(0xf6);
+    return *this;
+  }
+
+  CborWriter &
+  writeFloat(float value)
+  {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    m_sink.put(0xfa);
+    putBe(bits, 4);
+    return *this;
+  }
+
+  CborWriter &
+  writeString(const char *str)
+  {
+    return writeString(str, strlen(str));
+  }
+
+  CborWriter &
+  writeString(const char *str, size_t len)
+  {
+    writeHead(MajorString, len);
+    m_sink.put(reinterpret_cast<const uint8_t *>(str), len);
+    return *this;
+  }
+
+  CborWriter &
+  writeBytes(const uint8_t *data, size_t len)
+  {
+    writeHead(MajorBytes, len);
+    m_sink.put(data, len);
+    return *this;
+  }
+
+  CborWriter &
+  beginArray(size_t numItems)
+  {
+    writeHead(MajorArray, numItems);
+    return *this;
+  }
+
+  CborWriter &
+  beginMap(size_t numPairs)
+  {
+    writeHead(MajorMap, numPairs);
+    return *this;
+  }
+
+  /** Start a map of unknown size, must be closed with endIndefinite() */
+  CborWriter &
+  beginIndefiniteMap()
+  {
+    m_sink.put(0xbf);
+    return *this;
+  }
+
+  /** Start an array of unknown size, must be closed with endIndefinite() */
+  CborWriter &
+  beginIndefiniteArray()
+  {
+    m_sink.put(0x9f);
+    return *this;
+  }
+
+  CborWriter &
+  endIndefinite()
+  {
+    m_sink.put(0xff);
+    return *this;
+  }
+
+  void
+  reset()
+  {
+    m_sink.reset();
+  }
+
+  const uint8_t *
+  data() const
+  {
+    return m_sink.data();
+  }
+
+  size_t
+  size() const
+  {
+    return m_sink.size();
+  }
+
+  bool
+  ok() const
+  {
+    return not m_sink.overflow();
+  }
+
+  PayloadSink &
+  sink()
+  {
+    return m_sink;
+  }
+
+private:
+  void
+  writeHead(uint8_t major, uint32_t arg)
+  {
+    major <<= 5;
+    if (arg < 24) {
+      m_sink.put(major | arg);
+    } else if (arg <= 0xff) {
+      m_sink.put(major | 24);
+      putBe(arg, 1);
+    } else if (arg <= 0xffff) {
+      m_sink.put(major | 25);
+      putBe(arg, 2);
+    } else {
+      m_sink.put(major | 26);
+      putBe(arg, 4);
+    }
+  }
+
+  void
+  putBe(uint32_t value, uint8_t numBytes)
+  {
+    uint8_t buf[4];
+    for (uint8_t i = 0; i < numBytes; i++) {
+      buf[i] = value >> (8 * (numBytes - 1 - i));
+    }
+    m_sink.put(buf, numBytes);
+  }
+
+  PayloadSink m_sink;
+};
+
+/** Zero-allocation CBOR decoder.
+ *
+ * Reads in place from a received payload. Strings and byte strings are
+ * returned as pointers into the payload (not zero terminated). Only values
+ * fitting into 32 bits are supported, which covers everything CborWriter
+ * produces. All read functions return false on type mismatch or truncated
+ * input and leave the read position unchanged in that case.
+ */
+class CborReader
+{
+public:
+  typedef enum
+  {
+    TypeUint,
+    TypeNegInt,
+    TypeBytes,
+    TypeString,
+    TypeArray,
+    TypeMap,
+    TypeTag,
+    TypeFloat,
+    TypeBool,
+    TypeNull,
+    TypeBreak,
+    TypeInvalid,
+  } Type;
+
+  CborReader(const uint8_t *data, size_t len)
+    : m_data(data)
+    , m_len(len)
+    , m_pos(0)
+  { }
+
+  Type
+  peekType() const
+  {
+    if (m_pos >= m_len) {
+      return TypeInvalid;
+    }
+    uint8_t ib = m_data[m_pos];
+    switch (ib >> 5) {
+      case CborWriter::MajorUint:   return TypeUint;
+      case CborWriter::MajorNegInt: return TypeNegInt;
+      case CborWriter::MajorBytes:  return TypeBytes;
+      case CborWriter::MajorString: return TypeString;
+      case CborWriter::MajorArray:  return TypeArray;
+      case CborWriter::MajorMap:    return TypeMap;
+      case CborWriter::MajorTag:    return TypeTag;
+    }
+    switch (ib) {
+      case 0xf4:
+      case 0xf5: return TypeBool;
+      case 0xf6:
+      case 0xf7: return TypeNull;
+      case 0xf9:
+      case 0xfa:
+      case 0xfb: return TypeFloat;
+      case 0xff: return TypeBreak;
+    }
+    return TypeInvalid;
+  }
+
+  bool
+  readUint(uint32_t &value)
+  {
+    size_t pos = m_pos;
+    uint8_t major;
+    uint64_t arg;
+    if (not readHead(pos, major, arg) or major != CborWriter::MajorUint or arg > UINT32_MAX) {
+      return false;
+    }
+    value = arg;
+    m_pos = pos;
+    return true;
+  }
+
+  bool
+  readInt(int32_t &value)
+  {
+    size_t pos = m_pos;
+    uint8_t major;
+    uint64_t arg;
+    if (not readHead(pos, major, arg) or arg > INT32_MAX) {
+      return false;
+    }
+    if (major == CborWriter::MajorUint) {
+      value = static_cast<int32_t>(arg);
+    } else if (major == CborWriter::MajorNegInt) {
+      value = -1 - static_cast<int32_t>(arg);
+    } else {
+      return false;
+    }
+    m_pos = pos;
+    return true;
+  }
+
+  /** Reads a float. Integers, half, single and double precision are
+   * accepted and converted.
+   */
+  bool
+  readFloat(float &value)
+  {
+    if (m_pos >= m_len) {
+      return false;
+    }
+    uint8_t ib = m_data[m_pos];
+    if (ib == 0xf9 or ib == 0xfa or ib == 0xfb) {
+      size_t n = ib == 0xf9 ? 2 : ib == 0xfa ? 4 : 8;
+      if (m_pos + 1 + n > m_len) {
+        return false;
+      }
+      uint64_t bits = getBe(m_pos + 1, n);
+      if (n == 2) {
+        value = halfToFloat(bits);
+      } else if (n == 4) {
+        uint32_t b32 = bits;
+        memcpy(&value, &b32, sizeof(value));
+      } else {
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        value = d;
+      }
+      m_pos += 1 + n;
+      return true;
+    }
+    int32_t i;
+    if (readInt(i)) {
+      value = i;
+      return true;
+    }
+    return false;
+  }
+
+  bool
+  readBool(bool &value)
+  {
+    if (peekType() != TypeBool) {
+      return false;
+    }
+    value = m_data[m_pos++] == 0xf5;
+    return true;
+  }
+
+  bool
+  readNull()
+  {
+    if (peekType() != TypeNull) {
+      return false;
+    }
+    m_pos++;
+    return true;
+  }
+
+  bool
+  readString(const char *&str, size_t &len)
+  {
+    const uint8_t *data;
+    if (not readBlob(CborWriter::MajorString, data, len)) {
+      return false;
+    }
+    str = reinterpret_cast<const char *>(data);
+    return true;
+  }
+
+  bool
+  readBytes(const uint8_t *&data, size_t &len)
+  {
+    return readBlob(CborWriter::MajorBytes, data, len);
+  }
+
+  /** Reads an array header.
+   * @param numItems Number of items or SIZE_MAX for indefinite arrays which
+   * are terminated by a break (see readBreak()).
+   */
+  bool
+  readArray(size_t &numItems)
+  {
+    return readContainer(CborWriter::MajorArray, numItems);
+  }
+
+  /** Reads a map header, see readArray() */
+  bool
+  readMap(size_t &numPairs)
+  {
+    return readContainer(CborWriter::MajorMap, numPairs);
+  }
+
+  bool
+  readBreak()
+  {
+    if (peekType() != TypeBreak) {
+      return false;
+    }
+    m_pos++;
+    return true;
+  }
+
+  /** Skip the next complete item including nested containers */
+  bool
+  skip()
+  {
+    size_t pos = m_pos;
+    if (not skipItem(0)) {
+      m_pos = pos;
+      return false;
+    }
+    return true;
+  }
+
+  bool
+  atEnd() const
+  {
+    return m_pos >= m_len;
+  }
+
+  size_t
+  position() const
+  {
+    return m_pos;
+  }
+
+private:
+  static const uint8_t MaxNesting = 8;
+
+  bool
+  readHead(size_t &pos, uint8_t &major, uint64_t &arg) const
+  {
+    if (pos >= m_len) {
+      return false;
+    }
+    uint8_t ib = m_data[pos++];
+    major = ib >> 5;
+    uint8_t info = ib & 0x1f;
+    if (info < 24) {
+      arg = info;
+      return true;
+    }
+    if (info > 27) {
+      return false;
+    }
+    size_t n = 1 << (info - 24);
+    if (pos + n > m_len) {
+      return false;
+    }
+    arg = getBe(pos, n);
+    pos += n;
+    return true;
+  }
+
+  bool
+  readBlob(uint8_t expectedMajor, const uint8_t *&data, size_t &len)
+  {
+    size_t pos = m_pos;
+    uint8_t major;
+    uint64_t arg;
+    if (not readHead(pos, major, arg) or major != expectedMajor or arg > m_len - pos) {
+      return false;
+    }
+    data = m_data + pos;
+    len = arg;
+    m_pos = pos + len;
+    return true;
+  }
+
+  bool
+  readContainer(uint8_t expectedMajor, size_t &num)
+  {
+    if (m_pos < m_len and m_data[m_pos] == ((expectedMajor << 5) | 31)) {
+      num = SIZE_MAX;
+      m_pos++;
+      return true;
+    }
+    size_t pos = m_pos;
+    uint8_t major;
+    uint64_t arg;
+    if (not readHead(pos, major, arg) or major != expectedMajor or arg > UINT32_MAX) {
+      return false;
+    }
+    num = arg;
+    m_pos = pos;
+    return true;
+  }
+
+  bool
+  skipItem(uint8_t depth)
+  {
+    if (depth > MaxNesting or m_pos >= m_len) {
+      return false;
+    }
+    uint8_t ib = m_data[m_pos];
+    uint8_t major = ib >> 5;
+
+    if ((ib & 0x1f) == 31 and (major == CborWriter::MajorArray or major == CborWriter::MajorMap)) {
+      m_pos++;
+      while (not readBreak()) {
+        if (not skipItem(depth + 1)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    size_t pos = m_pos;
+    uint64_t arg;
+    if (not readHead(pos, major, arg)) {
+      return false;
+    }
+    switch (major) {
+      case CborWriter::MajorBytes:
+      case CborWriter::MajorString:
+        if (arg > m_len - pos) {
+          return false;
+        }
+        m_pos = pos + arg;
+        return true;
+      case CborWriter::MajorArray:
+      case CborWriter::MajorMap:
+      {
+        uint64_t items = major == CborWriter::MajorMap ? 2 * arg : arg;
+        m_pos = pos;
+        for (uint64_t i = 0; i < items; i++) {
+          if (not skipItem(depth + 1)) {
+            return false;
+          }
+        }
+        return true;
+      }
+      case CborWriter::MajorTag:
+        m_pos = pos;
+        return skipItem(depth + 1);
+      default:
+        m_pos = pos;
+        return true;
+    }
+  }
+
+  uint64_t
+  getBe(size_t pos, size_t n) const
+  {
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; i++) {
+      v = (v << 8) | m_data[pos + i];
+    }
+    return v;
+  }
+
+  static float
+  halfToFloat(uint16_t h)
+  {
+    int exp = (h >> 10) & 0x1f;
+    int mant = h & 0x3ff;
+    float val;
+    if (exp == 0) {
+      val = ldexpf(mant, -24);
+    } else if (exp != 31) {
+      val = ldexpf(mant + 1024, exp - 25);
+    } else {
+      val = mant == 0 ? INFINITY : NAN;
+    }
+    return h & 0x8000 ? -val : val;
+  }
+
+  const uint8_t *m_data;
+  size_t m_len;
+  size_t m_pos;
+};
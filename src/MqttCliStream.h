@@ -0,0 +1,389 @@
+#pragma once
+
+#include <MqttNetwork.h>
+
+/** A Stream which feeds commands received via MQTT into a command line
+ * interface and publishes the captured output.
+ *
+ * Hook it up to a second CliMqttClient instance to make the whole command
+ * set available over MQTT:
+ *
+ *   MqttCliStream<> mqttCliStream(networkManager);
+ *   CliMqttClient<FlashSettingsType> mqttCli(mqttCliStream, flashSettings, networkManager);
+ *
+ *   setup():  mqttCliStream.begin();
+ *   loop():   mqttCli.run(); mqttCliStream.run();
+ *
+ * The device listens on "<prefix>/cli" (prefix see
+ * NetworkManager::topicPrefix()). Commands are not authenticated, anybody
+ * allowed to publish to that topic on the broker controls the device. A CLI
+ * attached to this stream therefore masks passwords in its output.
+ *
+ * Optionally the device also listens on a broadcast topic shared by a whole
+ * fleet. This must be enabled explicitly:
+ *
+ *   setup():  mqttCliStream.setBroadcastEnabled(true);
+ *             mqttCliStream.begin("all/cli");
+ *
+ * A message is a batch of commands, one per line. If the first line starts
+ * with "@" the remainder of it is used as request id:
+ *
+ *   @42
+ *   m.server broker.local
+ *   m.user sensor
+ *
+ * Once all commands of a batch have been processed, the collected output is
+ * published as a single message on "<prefix>/cli/response", prefixed with the
+ * request id line so responses from many devices can be correlated:
+ *
+ *   @42
+ *   new MQTT server name "broker.local" stored to flash. ...
+ *
+ * While a batch is being processed further batches are rejected with a
+ * "busy" response. Like all responses it is published from run().
+ */
+template <size_t _InputBufferSize  = 256,
+          size_t _OutputBufferSize = 1024,
+          size_t _MaxRequestIdLen  = 15>
+class MqttCliStream
+  : public Stream
+{
+public:
+  MqttCliStream(NetworkManager &networkManager, char eolChar = '\n')
+    : m_networkManager(networkManager)
+    , m_eolChar(eolChar)
+    , m_broadcastTopic(nullptr)
+    , m_broadcastEnabled(false)
+    , m_subscribed(false)
+    , m_generation(0)
+    , m_inLen(0)
+    , m_inPos(0)
+    , m_outLen(0)
+    , m_outOverflow(false)
+    , m_batchActive(false)
+    , m_numBatches(0)
+    , m_numRejected(0)
+    , m_rejectLen(0)
+  {
+    m_requestId[0] = 0;
+    m_commandTopic[0] = 0;
+    m_responseTopic[0] = 0;
+  }
+
+  /** Build the device topics and subscribe. run() rebuilds them and
+   * subscribes again when the topic prefix changes, see
+   * NetworkManager::topicPrefixChanged().
+   * @param broadcastTopic Optional fleet wide command topic, only subscribed
+   * if enabled by setBroadcastEnabled(). The string is not copied and must
+   * remain valid.
+   */
+  void
+  begin(const char *broadcastTopic = nullptr)
+  {
+    m_networkManager.unsubscribe(&MqttCliStream::onMessage, this);
+
+    buildTopics();
+    m_broadcastTopic = broadcastTopic;
+
+    m_networkManager.subscribe(m_commandTopic, &MqttCliStream::onMessage, this);
+    m_subscribed = true;
+    if (m_broadcastTopic and m_broadcastEnabled) {
+      m_networkManager.subscribe(m_broadcastTopic, &MqttCliStream::onMessage, this);
+    }
+  }
+
+  /** Accept commands on the broadcast topic passed to begin(). Off by
+   * default: a single unauthenticated message on it reconfigures every
+   * device of the fleet. Takes effect with the next begin().
+   */
+  void
+  setBroadcastEnabled(bool enable)
+  {
+    m_broadcastEnabled = enable;
+  }
+
+  bool
+  broadcastEnabled() const
+  {
+    return m_broadcastEnabled;
+  }
+
+  /** Publishes the response as soon as the CLI has consumed the complete
+   * batch. Call after running the CLI this stream is attached to.
+   */
+  void
+  run()
+  {
+    if (m_rejectLen) {
+      publishRaw(m_reject, m_rejectLen);
+      m_rejectLen = 0;
+    }
+
+    if (not m_batchActive) {
+      followTopicPrefix();
+      return;
+    }
+    if (m_inPos < m_inLen) {
+      return;
+    }
+    if (m_outOverflow) {
+      static const char Truncated[] = "...output truncated\n";
+      size_t n = sizeof(Truncated) - 1;
+      memcpy(out() + _OutputBufferSize - n, Truncated, n);
+    }
+    publishResponse(out(), m_outLen);
+
+    m_inLen = m_inPos = 0;
+    m_outLen = 0;
+    m_outOverflow = false;
+    m_batchActive = false;
+
+    /* a batch changing the prefix still gets its response on the old
+     * topic, the new topics apply from here on
+     */
+    followTopicPrefix();
+  }
+
+  /** Process a batch as if it had been received on the command topic, e.g.
+   * to benchmark or test a CLI without a broker. Works without begin(), the
+   * response goes to "<prefix>/cli/response" nevertheless.
+   */
+  void
+  feed(const char *batch, size_t length)
+  {
+    if (not m_responseTopic[0]) {
+      buildTopics();
+    }
+    receive(reinterpret_cast<const uint8_t *>(batch), length);
+  }
+
+  bool
+  busy() const
+  {
+    return m_batchActive;
+  }
+
+  unsigned long
+  numBatches() const
+  {
+    return m_numBatches;
+  }
+
+  unsigned long
+  numRejected() const
+  {
+    return m_numRejected;
+  }
+
+  /* Stream interface */
+
+  int
+  available() override
+  {
+    return m_inLen - m_inPos;
+  }
+
+  int
+  read() override
+  {
+    return m_inPos < m_inLen ? static_cast<uint8_t>(m_in[m_inPos++]) : -1;
+  }
+
+  int
+  peek() override
+  {
+    return m_inPos < m_inLen ? static_cast<uint8_t>(m_in[m_inPos]) : -1;
+  }
+
+  size_t
+  write(uint8_t c) override
+  {
+    if (m_outLen >= _OutputBufferSize) {
+      m_outOverflow = true;
+      return 0;
+    }
+    out()[m_outLen++] = c;
+    return 1;
+  }
+
+  /* Print::write(buffer, size) calls write(uint8_t) for each byte, this one
+   * copies in one go.
+   */
+  size_t
+  write(const uint8_t *buffer, size_t size) override
+  {
+    size_t n = size;
+    if (m_outLen + n > _OutputBufferSize) {
+      n = _OutputBufferSize - m_outLen;
+      m_outOverflow = true;
+    }
+    memcpy(out() + m_outLen, buffer, n);
+    m_outLen += n;
+    return n;
+  }
+
+  using Print::write;
+
+  int
+  availableForWrite()
+  {
+    return _OutputBufferSize - m_outLen;
+  }
+
+private:
+  static_assert(_OutputBufferSize >= 32, "MQTT CLI output buffer too small");
+
+  char *
+  out()
+  {
+    return m_response + _MaxRequestIdLen + 2;
+  }
+
+  void
+  buildTopics()
+  {
+    m_generation = m_networkManager.topicPrefixGeneration();
+    const char *prefix = m_networkManager.topicPrefix();
+    snprintf(m_commandTopic, sizeof(m_commandTopic), "%s/cli", prefix);
+    snprintf(m_responseTopic, sizeof(m_responseTopic), "%s/cli/response", prefix);
+  }
+
+  /** Rebuild the topics if the topic prefix changed since they were built */
+  void
+  followTopicPrefix()
+  {
+    if (not m_responseTopic[0] or m_generation == m_networkManager.topicPrefixGeneration()) {
+      return;
+    }
+    if (m_subscribed) {
+      begin(m_broadcastTopic);
+    } else {
+      buildTopics();
+    }
+  }
+
+  static void
+  onMessage(void *context, const char *, const uint8_t *payload, unsigned int length)
+  {
+    static_cast<MqttCliStream *>(context)->receive(payload, length);
+  }
+
+  void
+  receive(const uint8_t *payload, unsigned int length)
+  {
+    const char *p = reinterpret_cast<const char *>(payload);
+    const char *end = p + length;
+
+    /* optional request id line */
+    const char *id = nullptr;
+    size_t idLen = 0;
+    if (p < end and *p == '@') {
+      id = ++p;
+      while (p < end and *p != m_eolChar and *p != '\r') {
+        p++;
+      }
+      idLen = p - id;
+      while (p < end and (*p == m_eolChar or *p == '\r')) {
+        p++;
+      }
+    }
+    if (idLen > _MaxRequestIdLen) {
+      idLen = _MaxRequestIdLen;
+    }
+
+    if (m_batchActive) {
+      reject(id, idLen, "busy");
+      return;
+    }
+
+    size_t len = end - p;
+    if (len + 1 > _InputBufferSize) {
+      reject(id, idLen, "batch too large");
+      return;
+    }
+
+    memcpy(m_requestId, id ? id : "", idLen);
+    m_requestId[idLen] = 0;
+
+    memcpy(m_in, p, len);
+    /* make sure the last command gets terminated */
+    if (len == 0 or m_in[len - 1] != m_eolChar) {
+      m_in[len++] = m_eolChar;
+    }
+    m_inLen = len;
+    m_inPos = 0;
+    m_outLen = 0;
+    m_outOverflow = false;
+    m_batchActive = true;
+    m_numBatches++;
+  }
+
+  /** Queue a rejection reply for run(). Only the latest one is kept if
+   * several batches are rejected in between.
+   */
+  void
+  reject(const char *id, size_t idLen, const char *reason)
+  {
+    m_numRejected++;
+    int n = snprintf(m_reject, sizeof(m_reject), "@%.*s\n%s\n",
+                     static_cast<int>(idLen), id ? id : "", reason);
+    m_rejectLen = n < static_cast<int>(sizeof(m_reject)) ? n : sizeof(m_reject) - 1;
+  }
+
+  void
+  publishResponse(const char *output, size_t len)
+  {
+    /* prepend request id line in front of the output. The output buffer
+     * reserves room for it, so the response goes out in one message.
+     */
+    size_t idLen = strlen(m_requestId);
+    size_t headerLen = idLen + 2;
+    memmove(m_response + headerLen, output, len);
+    m_response[0] = '@';
+    memcpy(m_response + 1, m_requestId, idLen);
+    m_response[idLen + 1] = '\n';
+    publishRaw(m_response, headerLen + len);
+  }
+
+  void
+  publishRaw(const char *data, size_t len)
+  {
+    m_networkManager.publish(m_responseTopic,
+                             reinterpret_cast<const uint8_t *>(data),
+                             len,
+                             false,
+                             PriorityControl);
+  }
+
+  NetworkManager &m_networkManager;
+  char m_eolChar;
+
+  char m_commandTopic[MaxMqttClientNameLen + 1 + 4];
+  char m_responseTopic[MaxMqttClientNameLen + 1 + 13];
+  const char *m_broadcastTopic;
+  bool m_broadcastEnabled;
+  bool m_subscribed;
+  /* topic prefix generation the topics were built for */
+  uint32_t m_generation;
+
+  char m_requestId[_MaxRequestIdLen + 1];
+
+  char m_in[_InputBufferSize];
+  size_t m_inLen;
+  size_t m_inPos;
+
+  /* Response layout: "@<request id>\n" followed by the captured output.
+   * The output is captured behind the largest possible header (see out()).
+   */
+  char m_response[_MaxRequestIdLen + 2 + _OutputBufferSize];
+  size_t m_outLen;
+  bool m_outOverflow;
+
+  bool m_batchActive;
+  unsigned long m_numBatches;
+  unsigned long m_numRejected;
+
+  /* pending rejection reply, see reject() */
+  char m_reject[_MaxRequestIdLen + 24];
+  size_t m_rejectLen;
+};
@@ -25,6 +25,9 @@
 #include <TelnetServer.h>
 #include <MqttFlash.h>
 #include <MqttNetwork.h>
+#include <MqttCliStream.h>
+#include <MqttLogSink.h>
+#include <MqttBench.h>
 
 template<class FlashSettingsType,
          size_t _NumCommandSets    =   2,
@@ -42,6 +45,7 @@ private:
 protected:
   FlashSettingsType &m_flashSettings;
   NetworkManager &m_networkManager;
+  bool m_maskSecrets;
 
 public:
   typedef StreamCmd<_NumCommandSets,
@@ -72,39 +76,86 @@ public:
     : SCBase(stream, eolChar, prompt)
     , m_flashSettings(flashSettings)
     , m_networkManager(networkManager)
+    , m_maskSecrets(false)
   {
     /* WARNING: Due to the static nature of StreamCmd any overflow of the command list will go unnoticed, since this object is initialized in global scope.
      */
-    addCommand("help",      &CliMqttClient::cmdHelp);
-    addCommand(".",         &CliMqttClient::cmdHelp);
-    addCommand("?",         &CliMqttClient::cmdHelp);
-    addCommand("n.",        &CliMqttClient::cmdHelp);
-    addCommand("m.",        &CliMqttClient::cmdHelp);
-
-    addCommand("debug",     &CliMqttClient::cmdDebug);
-    addCommand("reboot",    &CliMqttClient::cmdReboot);
-
-    addCommand("n.rssi",    &CliMqttClient::cmdNetworkRssi);
-    addCommand("n.list",    &CliMqttClient::cmdNetworkList);
-    addCommand("n.ssid",    &CliMqttClient::cmdNetworkSsid);
-    addCommand("n.ssidr",   &CliMqttClient::cmdNetworkSsid); /* undocumented wifi SSID reset */
-    addCommand("n.pass",    &CliMqttClient::cmdNetworkPass);
-    addCommand("n.passr",   &CliMqttClient::cmdNetworkPass); /* undocumented wifi pass reset */
-    addCommand("n.roaming", &CliMqttClient::cmdNetworkRoaming);
-    addCommand("n.connect", &CliMqttClient::cmdNetworkConnect);
-    addCommand("n.host",    &CliMqttClient::cmdNetworkHostName);
-    addCommand("n.telnet",  &CliMqttClient::cmdNetworkTelnet);
-    addCommand("n.info",    &CliMqttClient::cmdNetworkInfo);
-
-    addCommand("m.server", &CliMqttClient::cmdMqttServer);
-    addCommand("m.port", &CliMqttClient::cmdMqttPort);
-    addCommand("m.user", &CliMqttClient::cmdMqttUser);
-    addCommand("m.pass", &CliMqttClient::cmdMqttPass);
-    addCommand("m.client", &CliMqttClient::cmdMqttClient);
+    addCommand("help",      &CliMqttClient::watched<&CliMqttClient::cmdHelp>);
+    addCommand(".",         &CliMqttClient::watched<&CliMqttClient::cmdHelp>);
+    addCommand("?",         &CliMqttClient::watched<&CliMqttClient::cmdHelp>);
+    addCommand("n.",        &CliMqttClient::watched<&CliMqttClient::cmdHelp>);
+    addCommand("m.",        &CliMqttClient::watched<&CliMqttClient::cmdHelp>);
+
+    addCommand("debug",     &CliMqttClient::watched<&CliMqttClient::cmdDebug>);
+    addCommand("reboot",    &CliMqttClient::watched<&CliMqttClient::cmdReboot>);
+    addCommand("bench",     &CliMqttClient::watched<&CliMqttClient::cmdBench>);
+
+    addCommand("n.rssi",    &CliMqttClient::watched<&CliMqttClient::cmdNetworkRssi>);
+    addCommand("n.list",    &CliMqttClient::watched<&CliMqttClient::cmdNetworkList>);
+    addCommand("n.ssid",    &CliMqttClient::watched<&CliMqttClient::cmdNetworkSsid>);
+    addCommand("n.ssidr",   &CliMqttClient::watched<&CliMqttClient::cmdNetworkSsid>); /* undocumented wifi SSID reset */
+    addCommand("n.pass",    &CliMqttClient::watched<&CliMqttClient::cmdNetworkPass>);
+    addCommand("n.passr",   &CliMqttClient::watched<&CliMqttClient::cmdNetworkPass>); /* undocumented wifi pass reset */
+    addCommand("n.roaming", &CliMqttClient::watched<&CliMqttClient::cmdNetworkRoaming>);
+    addCommand("n.connect", &CliMqttClient::watched<&CliMqttClient::cmdNetworkConnect>);
+    addCommand("n.host",    &CliMqttClient::watched<&CliMqttClient::cmdNetworkHostName>);
+    addCommand("n.telnet",  &CliMqttClient::watched<&CliMqttClient::cmdNetworkTelnet>);
+    addCommand("n.info",    &CliMqttClient::watched<&CliMqttClient::cmdNetworkInfo>);
+
+    addCommand("m.server", &CliMqttClient::watched<&CliMqttClient::cmdMqttServer>);
+    addCommand("m.port", &CliMqttClient::watched<&CliMqttClient::cmdMqttPort>);
+    addCommand("m.user", &CliMqttClient::watched<&CliMqttClient::cmdMqttUser>);
+    addCommand("m.pass", &CliMqttClient::watched<&CliMqttClient::cmdMqttPass>);
+    addCommand("m.client", &CliMqttClient::watched<&CliMqttClient::cmdMqttClient>);
+    addCommand("m.link", &CliMqttClient::watched<&CliMqttClient::cmdMqttLink>);
+    addCommand("m.stats", &CliMqttClient::watched<&CliMqttClient::cmdMqttStats>);
 
     setDefaultHandler(&CliMqttClient::cmdInvalid);
   }
 
+  /** A CLI on the remote MQTT command topic. Its output goes to the broker,
+   * so passwords are masked.
+   */
+  template <size_t _InputBufferSize, size_t _OutputBufferSize, size_t _MaxRequestIdLen>
+  CliMqttClient(MqttCliStream<_InputBufferSize, _OutputBufferSize, _MaxRequestIdLen> &stream,
+      FlashSettingsType &flashSettings,
+      NetworkManager &networkManager,
+      char eolChar = '\n',
+      const char* prompt = NULL)
+    : CliMqttClient(static_cast<Stream &>(stream), flashSettings, networkManager, eolChar, prompt)
+  {
+    m_maskSecrets = true;
+  }
+
+  /** Process pending input, watched by the network manager's watchdog */
+  void run()
+  {
+    StallScope scope(m_networkManager.getWatchdog(), PhaseCli);
+    if (stream().available() > 0) {
+      m_networkManager.inputActivity(stream());
+    }
+    SCBase::run();
+  }
+
+  /** Command handler wrapper which names the command in the watchdog's
+   * stall reports. Register commands through it:
+   *   addCommand("x", &Cli::watched<&Cli::cmdX>);
+   */
+  template <void (CliMqttClient::*_Command)()>
+  void watched()
+  {
+    m_networkManager.getWatchdog().setDetail(current());
+    (this->*_Command)();
+  }
+
+  /** Passwords as printed by this CLI, masked if its output leaves the
+   * device via MQTT
+   */
+  const char* secret(const char *value) const
+  {
+    return m_maskSecrets and *value ? "********" : value;
+  }
+
   Print& printHex(const uint8_t *data, uint8_t len)
   {
     return printHex(stream(), data, len);
@@ -161,6 +212,8 @@ protected:
     "    off  disable debug logging\n"
     "reboot\n"
     "  reboot system\n"
+    "bench\n"
+    "  run benchmarks of the client's hot paths, prints CSV\n"
     ;
   }
 
@@ -197,6 +250,7 @@ protected:
   "      disables the telnet server\n"
   "    pass <pass>\n"
   "      sets the telnet login password to <password>\n"
+  "  the server is closed after ten minutes without input and restarted if enabled\n"
   "n.info\n"
   " print network setup info\n"
   ;
@@ -220,6 +274,12 @@ protected:
     "m.client [client]\n"
     "  with argument: set MQTT client name\n"
     "  without: show current MQTT client name\n"
+    "  changes of the above settings reconnect to the MQTT server\n"
+    "m.link\n"
+    "  show MQTT link health (round trip time, RSSI trend, keep alive)\n"
+    "m.stats [reset]\n"
+    "  without argument: show MQTT message counters and publish latency\n"
+    "  reset: clear statistics\n"
     ;
   }
 
@@ -278,8 +338,7 @@ protected:
         stream() << "invalid arguments\n";
         return;
     }
-// TODO
-//    Debug.enable(m_flashSettings.debug);
+    logger().setLevel(m_flashSettings.debug ? LogLevelDebug : LogLevelInfo);
     m_flashSettings.update();
   }
 
@@ -290,6 +349,16 @@ protected:
     ESP.restart();
   }
 
+  void cmdBench()
+  {
+    /* benchmarks run long on purpose */
+    StallWatchdog &wdt = m_networkManager.getWatchdog();
+    unsigned long budgetMs = wdt.budgetMs();
+    wdt.setBudget(0);
+    benchmarkClient<CliMqttClient>(stream(), m_networkManager, m_flashSettings);
+    wdt.setBudget(budgetMs);
+  }
+
   void cmdVersion()
   {
     PrintVersion(stream());
@@ -299,7 +368,7 @@ protected:
 
   void cmdNetworkRssi()
   {
-    stream() << "RSSI: " << WiFi.RSSI() << " dB\n";
+    stream() << "RSSI: " << m_networkManager.getNetworkInterface().rssi() << " dB\n";
   }
 
   void cmdNetworkSsid()
@@ -343,14 +412,14 @@ protected:
 
       if (not arg) {
         /* this is perhaps not a good idea, but can come in handy for now */
-        stream() << "wifi password: " << m_flashSettings.wifiPass << "\n";
+        stream() << "wifi password: " << secret(m_flashSettings.wifiPass) << "\n";
         return;
       }
     }
     strncpy(m_flashSettings.wifiPass, arg, MaxWifiPassLen);
     m_flashSettings.update();
 
-    stream() << "wifi pass \"" << arg << "\" stored to flash\n";
+    stream() << "wifi pass \"" << secret(arg) << "\" stored to flash\n";
   }
 
   void cmdNetworkConnect()
@@ -395,7 +464,7 @@ protected:
     };
     size_t op(OP_NONE);
     getOpt(op, "-a", "-b", "-c");
-    
+
     byte n = WiFi.scanNetworks();
     if (n) {
       stream() << "visible networks:\n";
@@ -427,6 +496,7 @@ protected:
 
     strncpy(m_flashSettings.hostName, arg, MaxHostNameLen);
     m_flashSettings.update();
+    m_networkManager.topicPrefixChanged();
 
     stream() << "new host name \"" << arg << "\" stored to flash. restarting network...\n";
 
@@ -474,7 +544,7 @@ protected:
         }
         break;
       case ArgNone:
-        stream() << "the telnet server is " << (m_flashSettings.telnetEnabled ? "on" : "off") << ", the login password is \"" << m_flashSettings.telnetPass << "\"\n";
+        stream() << "the telnet server is " << (m_flashSettings.telnetEnabled ? "on" : "off") << ", the login password is \"" << secret(m_flashSettings.telnetPass) << "\"\n";
         return;
       default:
         stream() << "invalid argument \"" << current() << "\", see \"help\" for proper use\n";
@@ -500,11 +570,12 @@ protected:
       << "MQTT server:      " << confi(m_flashSettings.mqttServer) << "\n"
       << "MQTT user:        " << confi(m_flashSettings.mqttUser) << "\n"
       << "MQTT client name: " << confi(m_flashSettings.mqttClientName) << "\n"
+      << "telnet server:    " << (m_networkManager.telnetRunning() ? "running" : "stopped") << "\n"
       ;
-    if (WiFi.status() == WL_CONNECTED) {
+    if (m_networkManager.getNetworkInterface().connected()) {
       stream()
         << "WiFi:             connected\n"
-        << "signal strength:  " << WiFi.RSSI() << " dB\n"
+        << "signal strength:  " << m_networkManager.getNetworkInterface().rssi() << " dB\n"
         << "IP:               " << WiFi.localIP() << "\n"
         ;
       if (strlen(m_flashSettings.mqttServer)) {
@@ -519,6 +590,11 @@ protected:
   }
   // MQTT commands
 
+  /* New values are validated before they are stored. The reconnect is
+   * deferred by the network manager, so all MQTT settings of a batch of
+   * commands are applied (and checked for consistency) at once.
+   */
+
   void cmdMqttServer()
   {
     const char* arg = next();
@@ -531,18 +607,41 @@ protected:
       stream() << "the MQTT server name can not be empty\n";
       return;
     }
+    const char *error = NetworkManager::mqttServerError(arg);
+    if (error) {
+      stream() << "MQTT server not changed: " << error << "\n";
+      return;
+    }
 
     strncpy(m_flashSettings.mqttServer, arg, MaxMqttServerNameLen);
     m_flashSettings.update();
 
     stream() << "new MQTT server name \"" << arg << "\" stored to flash. restarting mqtt...\n";
 
-    /* TODO mqtt restart */
+    m_networkManager.reconfigureMqtt();
   }
 
   void cmdMqttPort()
   {
-    /* TODO */
+    const char* arg = next();
+    if (not arg) {
+      stream() << "MQTT port: " << m_flashSettings.mqttPort << "\n";
+      return;
+    }
+
+    char *end;
+    unsigned long port = strtoul(arg, &end, 10);
+    if (*end or port == 0 or port > 65535) {
+      stream() << "invalid MQTT port \"" << arg << "\", must be within 1 .. 65535\n";
+      return;
+    }
+
+    m_flashSettings.mqttPort = port;
+    m_flashSettings.update();
+
+    stream() << "new MQTT port " << port << " stored to flash. restarting mqtt...\n";
+
+    m_networkManager.reconfigureMqtt();
   }
 
   void cmdMqttUser()
@@ -562,7 +661,7 @@ protected:
     strncpy(m_flashSettings.mqttUser, arg, MaxMqttUserNameLen);
     m_flashSettings.update();
 
-    /* TODO restart MQTT */
+    m_networkManager.reconfigureMqtt();
   }
 
   void cmdMqttPass()
@@ -576,13 +675,13 @@ protected:
     reset();
 
     if (not arg) {
-      stream() << "MQTT password: " << m_flashSettings.mqttPass << "\n";
+      stream() << "MQTT password: " << secret(m_flashSettings.mqttPass) << "\n";
       return;
     }
     strncpy(m_flashSettings.mqttPass, arg, MaxMqttPassLen);
     m_flashSettings.update();
 
-    /* TODO restart MQTT */
+    m_networkManager.reconfigureMqtt();
   }
 
   void cmdMqttClient()
@@ -599,12 +698,65 @@ protected:
       stream() << "MQTT client: " << m_flashSettings.mqttClientName << "\n";
       return;
     }
+    const char *error = NetworkManager::mqttClientNameError(arg);
+    if (error) {
+      stream() << "MQTT client not changed: " << error << "\n";
+      return;
+    }
     strncpy(m_flashSettings.mqttClientName, arg, MaxMqttClientNameLen);
     m_flashSettings.update();
+    m_networkManager.topicPrefixChanged();
 
-    /* TODO restart MQTT */
+    m_networkManager.reconfigureMqtt();
   }
 
+  void cmdMqttLink()
+  {
+    const LinkHealth &lh = m_networkManager.getLinkHealth();
+    stream()
+      << "RTT last/avg:     " << lh.lastRttMs() << "/" << lh.smoothedRttMs() << " ms\n"
+      << "RSSI avg/trend:   " << lh.rssiAverage() << "/" << lh.rssiTrend() << " dB\n"
+      << "keep alive:       " << lh.sessionKeepAliveS() << " s (next connect " << lh.keepAliveS() << " s)\n"
+      << "probes/missed:    " << lh.numProbes() << "/" << lh.numMissed() << "\n"
+      << "link reconnects:  " << lh.numReconnects() << "\n"
+      ;
+  }
+
+  void cmdMqttStats()
+  {
+    const char* arg = next();
+    if (arg) {
+      if (strcmp(arg, "reset") != 0) {
+        stream() << "invalid argument \"" << arg << "\", see \"help\" for proper use\n";
+        return;
+      }
+      m_networkManager.resetStats();
+      stream() << "MQTT statistics cleared\n";
+      return;
+    }
+
+    const MqttStats &st = m_networkManager.getStats();
+    const LatencyHistogram &lat = st.publishLatency;
+    stream()
+      << "published:        " << st.numPublished << " (" << st.bytesPublished << " bytes)\n"
+      << "publish failed:   " << st.numPublishFailed << "\n"
+      << "suppressed:       " << st.numSuppressed << "\n"
+      << "received:         " << st.numReceived << " (" << st.bytesReceived << " bytes)\n"
+      << "publish latency:  p50 " << lat.percentileUs(50)
+      << " p90 " << lat.percentileUs(90)
+      << " p99 " << lat.percentileUs(99)
+      << " max " << st.maxPublishUs << " us\n"
+      << "broker RTT:       " << m_networkManager.getLinkHealth().smoothedRttMs() << " ms\n"
+      ;
+
+    const PublishRateLimiter &rl = m_networkManager.getRateLimiter();
+    stream()
+      << "rate limit drops: control " << rl.numDropped(PriorityControl)
+      << ", alarm " << rl.numDropped(PriorityAlarm)
+      << ", telemetry " << rl.numDropped(PriorityTelemetry) << "\n"
+      << "link budget:      " << rl.linkLevel() << " %\n"
+      ;
+  }
 
   void cmdInvalid(const char *command)
   {
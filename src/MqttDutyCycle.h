@@ -0,0 +1,304 @@
+#pragma once
+
+#include <MqttNetwork.h>
+#include <MqttRetained.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+# include <esp_sleep.h>
+#endif
+
+#ifndef DutyCycleRtcBlock
+/* ESP8266: offset of the duty cycle state in the RTC user memory in 4 byte
+ * blocks, see RetainedMemory
+ */
+#  define DutyCycleRtcBlock 64
+#endif
+
+/** State of a DutyCycle kept across deep sleep */
+struct DutyCycleState
+{
+  static const uint32_t Magic = 0x44555459;
+
+  uint32_t magic;
+  /* access point of the last successful cycle for the directed join */
+  int32_t channel;
+  uint8_t bssid[6];
+  uint8_t bssidValid;
+  uint8_t lastFastJoin;
+
+  uint32_t numCycles;
+  /* cycles ending without confirmed publish */
+  uint32_t numFailed;
+  uint32_t numConfirmed;
+  uint32_t numLost;
+
+  /* timing of the last cycle in ms after wake up, lastFastJoin is set
+   * for the current cycle already
+   */
+  uint32_t lastJoinMs;
+  uint32_t lastMqttMs;
+  uint32_t lastAwakeMs;
+  uint32_t totalAwakeMs;
+};
+
+/** Wake - publish - sleep operation for battery powered devices.
+ *
+ * After wake up the NetworkManager joins the access point of the last cycle
+ * directly (no scan) with mDNS and telnet disabled. Once MQTT is connected
+ * the queued messages are published, followed by a link probe. The probe
+ * returning confirms that the broker received all messages before it (the
+ * MQTT client publishes QoS 0 only), then the device goes to deep sleep.
+ * If the cycle does not complete within the awake budget, the device sleeps
+ * anyway and the next cycle joins with a regular scan.
+ *
+ * Counters and the timing of the last cycle are kept in RetainedMemory and
+ * published on "<prefix>/$SYS/cycle" at the start of each flush, so the
+ * awake time can be optimized:
+ *
+ *   DutyCycle<> dutyCycle(networkManager);
+ *
+ *   setup():
+ *     ...
+ *     dutyCycle.enqueue(temperatureTopic, measurement);
+ *     dutyCycle.begin(300);
+ *   loop():
+ *     dutyCycle.run();
+ */
+template <size_t _QueueSize     = 8,
+          size_t _MaxPayloadLen = 64>
+class DutyCycle
+{
+public:
+  static const unsigned long DefaultAwakeBudgetMs = 10000;
+
+  typedef enum
+  {
+    StateIdle,
+    StateConnecting,
+    StateConfirming,
+  } State;
+
+  DutyCycle(NetworkManager &networkManager)
+    : m_networkManager(networkManager)
+    , m_state(StateIdle)
+    , m_sleepS(0)
+    , m_awakeBudgetMs(DefaultAwakeBudgetMs)
+    , m_queueLength(0)
+    , m_numSent(0)
+    , m_probeSeq(0)
+    , m_joinMs(0)
+    , m_mqttMs(0)
+  { }
+
+  /** Queue a message for the next flush
+   * @param topic Must remain valid until the message has been published
+   * @return false if the queue is full or the payload too large
+   */
+  bool
+  enqueue(const char *topic, const uint8_t *payload, unsigned int length, bool retained = false)
+  {
+    if (m_queueLength >= _QueueSize or length > _MaxPayloadLen) {
+      return false;
+    }
+    Message &m = m_queue[m_queueLength++];
+    m.topic = topic;
+    memcpy(m.payload, payload, length);
+    m.length = length;
+    m.retained = retained;
+    return true;
+  }
+
+  bool
+  enqueue(const char *topic, const char *payload, bool retained = false)
+  {
+    return enqueue(topic, reinterpret_cast<const uint8_t *>(payload), strlen(payload), retained);
+  }
+
+  bool
+  enqueue(const char *topic, const PayloadWriter &payload, bool retained = false)
+  {
+    return payload.ok() and enqueue(topic, payload.data(), payload.size(), retained);
+  }
+
+  /** Start the cycle, replaces NetworkManager::begin()
+   * @param sleepS Deep sleep duration after the cycle
+   */
+  void
+  begin(unsigned long sleepS)
+  {
+    m_sleepS = sleepS;
+
+    if (not Memory::read(m_retained) or m_retained.magic != DutyCycleState::Magic) {
+      memset(&m_retained, 0, sizeof(m_retained));
+      m_retained.magic = DutyCycleState::Magic;
+    }
+    m_retained.numCycles++;
+    m_retained.lastFastJoin = m_retained.bssidValid;
+
+    m_networkManager.setLocalServices(false);
+    m_networkManager.setDirectedJoin(m_retained.channel,
+                                     m_retained.bssidValid ? m_retained.bssid : nullptr);
+    m_networkManager.begin();
+    m_state = StateConnecting;
+  }
+
+  /** Maximum time awake per cycle */
+  void
+  setAwakeBudget(unsigned long ms)
+  {
+    m_awakeBudgetMs = ms;
+  }
+
+  /** Call from loop(), does not return once the cycle is complete */
+  void
+  run()
+  {
+    m_networkManager.run();
+
+    unsigned long now = millis();
+    if (not m_joinMs and m_networkManager.isConnected()) {
+      m_joinMs = now;
+    }
+
+    switch (m_state) {
+
+      case StateIdle:
+        return;
+
+      case StateConnecting:
+        if (m_networkManager.getMqttClient().connected()) {
+          m_mqttMs = now;
+          flush();
+          m_probeSeq = m_networkManager.sendProbe();
+          m_state = StateConfirming;
+        }
+        break;
+
+      case StateConfirming:
+        if (not m_networkManager.getMqttClient().connected()) {
+          /* the session dropped, publish again on reconnect */
+          m_state = StateConnecting;
+          break;
+        }
+        if (m_networkManager.getLinkHealth().probeAckSeq() >= m_probeSeq) {
+          m_retained.numConfirmed += m_numSent;
+          m_retained.numLost += m_queueLength - m_numSent;
+          m_numSent = 0;
+          m_queueLength = 0;
+          sleep(true);
+          return;
+        }
+        break;
+    }
+
+    if (now > m_awakeBudgetMs) {
+      LOG_WARN("duty", "cycle not complete within %lu ms", m_awakeBudgetMs);
+      m_retained.numLost += m_queueLength;
+      sleep(false);
+    }
+  }
+
+  const DutyCycleState &
+  getRetainedState() const
+  {
+    return m_retained;
+  }
+
+private:
+  typedef RetainedMemory<DutyCycleState, DutyCycleRtcBlock> Memory;
+
+  struct Message
+  {
+    const char *topic;
+    uint8_t payload[_MaxPayloadLen];
+    uint16_t length;
+    bool retained;
+  };
+
+  void
+  flush()
+  {
+    char topic[MaxMqttClientNameLen + 1 + 11];
+    snprintf(topic, sizeof(topic), "%s/$SYS/cycle", m_networkManager.topicPrefix());
+
+    const DutyCycleState &st = m_retained;
+    uint8_t buf[160];
+    PayloadWriter w(ContentFormatText, buf, sizeof(buf));
+    w.beginObject()
+      .field("cycle", static_cast<unsigned long>(st.numCycles))
+      .field("lastAwakeMs", static_cast<unsigned long>(st.lastAwakeMs))
+      .field("lastJoinMs", static_cast<unsigned long>(st.lastJoinMs))
+      .field("lastMqttMs", static_cast<unsigned long>(st.lastMqttMs))
+      .field("lastFast", st.lastFastJoin != 0)
+      .field("failed", static_cast<unsigned long>(st.numFailed))
+      .field("lost", static_cast<unsigned long>(st.numLost))
+      .endObject();
+    m_networkManager.publish(topic, w);
+
+    m_numSent = 0;
+    for (size_t i = 0; i < m_queueLength; i++) {
+      const Message &m = m_queue[i];
+      if (m_networkManager.publish(m.topic, m.payload, m.length, m.retained, PriorityAlarm)) {
+        m_numSent++;
+      }
+    }
+  }
+
+  void
+  sleep(bool confirmed)
+  {
+    unsigned long awakeMs = millis();
+
+    if (not confirmed) {
+      m_retained.numFailed++;
+    }
+
+    int32_t channel;
+    uint8_t bssid[6];
+    if (confirmed and m_networkManager.getNetworkInterface().linkParameters(channel, bssid)) {
+      m_retained.channel = channel;
+      memcpy(m_retained.bssid, bssid, sizeof(bssid));
+      m_retained.bssidValid = true;
+    } else if (not m_joinMs) {
+      /* the access point may have moved, scan next time */
+      m_retained.bssidValid = false;
+    }
+
+    m_retained.lastJoinMs = m_joinMs;
+    m_retained.lastMqttMs = m_mqttMs;
+    m_retained.lastAwakeMs = awakeMs;
+    m_retained.totalAwakeMs += awakeMs;
+    Memory::write(m_retained);
+
+    LOG_INFO("duty", "cycle %lu done after %lu ms, sleeping %lu s",
+             static_cast<unsigned long>(m_retained.numCycles), awakeMs, m_sleepS);
+    logger().flush();
+
+    m_networkManager.getMqttClient().disconnect();
+    m_networkManager.disconnect();
+    m_state = StateIdle;
+
+    uint64_t sleepUs = static_cast<uint64_t>(m_sleepS) * 1000000ULL;
+#if defined(ARDUINO_ARCH_ESP32)
+    /* EspClass::deepSleep() takes 32 bits, which ends after 71 minutes */
+    esp_deep_sleep(sleepUs);
+#else
+    ESP.deepSleep(sleepUs);
+#endif
+  }
+
+  NetworkManager &m_networkManager;
+  State m_state;
+  unsigned long m_sleepS;
+  unsigned long m_awakeBudgetMs;
+
+  Message m_queue[_QueueSize];
+  size_t m_queueLength;
+  size_t m_numSent;
+  uint32_t m_probeSeq;
+
+  unsigned long m_joinMs;
+  unsigned long m_mqttMs;
+
+  DutyCycleState m_retained;
+};
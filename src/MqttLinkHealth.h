@@ -0,0 +1,328 @@
+#pragma once
+
+#include <Arduino.h>
+
+/** Link quality bookkeeping for the MQTT connection.
+ *
+ * When no MQTT message has been sent or received for 3/4 of the keep alive
+ * interval, the NetworkManager publishes a probe message to a topic it is
+ * subscribed to itself. The time until the probe returns is the round trip
+ * time through WiFi, TCP and broker. A probe goes out only where the MQTT
+ * client would send a PINGREQ, whose PINGRESP is not observable, and
+ * counts as traffic itself, so it replaces that ping. Links busy with other
+ * traffic are not probed at all. Probes do not show up in the MQTT
+ * statistics.
+ *
+ * From RTT, missed probes and the RSSI trend the keep alive interval is
+ * adapted within configurable bounds: shorter on a degrading link, so a
+ * half-open connection is detected early, longer on a good link to save
+ * airtime and battery. A shorter interval takes effect immediately, a longer
+ * one with the next connect, since the broker enforces the interval
+ * announced when connecting. After MaxMissedProbes consecutive missed probes a
+ * reconnect is requested instead of waiting for the TCP stack to time out.
+ */
+class LinkHealth
+{
+public:
+  typedef enum
+  {
+    ActionNone,
+    ActionProbe,
+    ActionReconnect,
+  } Action;
+
+  static const uint16_t DefaultMinKeepAliveS = 10;
+  static const uint16_t DefaultMaxKeepAliveS = 120;
+  static const uint16_t InitialKeepAliveS = 15;
+
+  /* A probe not returning within ... is considered missed */
+  static const unsigned long ProbeTimeoutMs = 5000;
+  static const uint8_t MaxMissedProbes = 2;
+
+  /* Thresholds for link classification */
+  static const int32_t GoodRssi = -70;
+  static const int32_t WeakRssi = -82;
+  static const unsigned long GoodRttMs = 250;
+  static const unsigned long BadRttMs = 1500;
+  /* Number of consecutive good probes before the keep alive is extended */
+  static const uint8_t GoodProbesToExtend = 4;
+
+  LinkHealth()
+    : m_minKeepAliveS(DefaultMinKeepAliveS)
+    , m_maxKeepAliveS(DefaultMaxKeepAliveS)
+    , m_keepAliveS(InitialKeepAliveS)
+    , m_sessionKeepAliveS(InitialKeepAliveS)
+    , m_numProbes(0)
+    , m_numMissed(0)
+    , m_numReconnects(0)
+  {
+    reset(0, InitialKeepAliveS);
+  }
+
+  /** Restart monitoring, call when the MQTT connection has been established
+   * @param sessionKeepAliveS The keep alive interval used for connecting
+   */
+  void
+  reset(unsigned long now, uint16_t sessionKeepAliveS)
+  {
+    m_sessionKeepAliveS = sessionKeepAliveS;
+    m_probeSeq = 0;
+    m_probeAckSeq = 0;
+    m_probeOutstanding = false;
+    m_probeSentMs = now;
+    m_lastTrafficMs = now;
+    m_lastRttMs = 0;
+    m_srttMs = 0;
+    m_consecutiveMissed = 0;
+    m_consecutiveGood = 0;
+    m_rssiAvg = 0;
+    m_rssiTrend = 0;
+  }
+
+  /** Evaluate the link. Call regularly while the MQTT client is connected.
+   * @return ActionProbe if a probe should be sent (see probeSent()),
+   * ActionReconnect if the link is considered dead.
+   */
+  Action
+  run(unsigned long now)
+  {
+    if (m_probeOutstanding) {
+      if (now - m_probeSentMs < ProbeTimeoutMs) {
+        return ActionNone;
+      }
+      m_probeOutstanding = false;
+      m_numMissed++;
+      m_consecutiveMissed++;
+      m_consecutiveGood = 0;
+      shrinkKeepAlive();
+      if (m_consecutiveMissed >= MaxMissedProbes) {
+        m_numReconnects++;
+        return ActionReconnect;
+      }
+      /* retry right away */
+      return ActionProbe;
+    }
+
+    /* probe an idle link a bit before the MQTT client would ping */
+    if (now - m_lastTrafficMs >= m_sessionKeepAliveS * 750UL) {
+      return ActionProbe;
+    }
+    return ActionNone;
+  }
+
+  /** Record an MQTT message sent or received, which defers the next probe */
+  void
+  traffic(unsigned long now)
+  {
+    m_lastTrafficMs = now;
+  }
+
+  /** Record a sent probe
+   * @return The sequence number to put into the probe
+   */
+  uint32_t
+  probeSent(unsigned long now, int32_t rssi)
+  {
+    m_probeOutstanding = true;
+    m_probeSentMs = now;
+    m_lastTrafficMs = now;
+    m_numProbes++;
+    sampleRssi(rssi);
+    return ++m_probeSeq;
+  }
+
+  /** Record a returned probe */
+  void
+  probeReceived(uint32_t seq, unsigned long now)
+  {
+    if (not m_probeOutstanding or seq != m_probeSeq) {
+      /* late or foreign probe */
+      return;
+    }
+    m_probeOutstanding = false;
+    m_probeAckSeq = seq;
+    m_consecutiveMissed = 0;
+
+    m_lastRttMs = now - m_probeSentMs;
+    /* exponentially weighted moving average, alpha = 1/4 */
+    m_srttMs = m_srttMs ? (3 * m_srttMs + m_lastRttMs) / 4 : m_lastRttMs;
+
+    if (m_srttMs > BadRttMs or m_rssiAvg < WeakRssi) {
+      m_consecutiveGood = 0;
+      shrinkKeepAlive();
+    } else if (m_srttMs < GoodRttMs and m_rssiAvg > GoodRssi and m_rssiTrend >= 0) {
+      if (++m_consecutiveGood >= GoodProbesToExtend) {
+        m_consecutiveGood = 0;
+        extendKeepAlive();
+      }
+    } else {
+      m_consecutiveGood = 0;
+    }
+  }
+
+  void
+  setKeepAliveBounds(uint16_t minS, uint16_t maxS)
+  {
+    m_minKeepAliveS = minS;
+    m_maxKeepAliveS = maxS < minS ? minS : maxS;
+    m_keepAliveS = constrainKeepAlive(m_keepAliveS);
+    if (m_keepAliveS < m_sessionKeepAliveS) {
+      m_sessionKeepAliveS = m_keepAliveS;
+    }
+  }
+
+  /** Lower bound of the keep alive interval, see setKeepAliveBounds() */
+  uint16_t
+  minKeepAliveS() const
+  {
+    return m_minKeepAliveS;
+  }
+
+  uint16_t
+  maxKeepAliveS() const
+  {
+    return m_maxKeepAliveS;
+  }
+
+  /** Keep alive interval to use for the next connect */
+  uint16_t
+  keepAliveS() const
+  {
+    return m_keepAliveS;
+  }
+
+  /** Keep alive interval to use for the current connection */
+  uint16_t
+  sessionKeepAliveS() const
+  {
+    return m_sessionKeepAliveS;
+  }
+
+  unsigned long
+  lastRttMs() const
+  {
+    return m_lastRttMs;
+  }
+
+  unsigned long
+  smoothedRttMs() const
+  {
+    return m_srttMs;
+  }
+
+  int32_t
+  rssiAverage() const
+  {
+    return m_rssiAvg;
+  }
+
+  /** RSSI change of the moving average between the last two samples */
+  int32_t
+  rssiTrend() const
+  {
+    return m_rssiTrend;
+  }
+
+  bool
+  probeOutstanding() const
+  {
+    return m_probeOutstanding;
+  }
+
+  /** Sequence number of the last probe sent */
+  uint32_t
+  probeSeq() const
+  {
+    return m_probeSeq;
+  }
+
+  /** Sequence number of the last probe returned in time, since the probes
+   * travel in order with other messages all messages published before have
+   * reached the broker as well.
+   */
+  uint32_t
+  probeAckSeq() const
+  {
+    return m_probeAckSeq;
+  }
+
+  unsigned long
+  numProbes() const
+  {
+    return m_numProbes;
+  }
+
+  unsigned long
+  numMissed() const
+  {
+    return m_numMissed;
+  }
+
+  unsigned long
+  numReconnects() const
+  {
+    return m_numReconnects;
+  }
+
+private:
+  void
+  sampleRssi(int32_t rssi)
+  {
+    if (m_rssiAvg == 0) {
+      m_rssiAvg = rssi;
+      return;
+    }
+    int32_t avg = (3 * m_rssiAvg + rssi) / 4;
+    m_rssiTrend = avg - m_rssiAvg;
+    m_rssiAvg = avg;
+    if (m_rssiTrend < -3) {
+      /* rapidly falling signal */
+      shrinkKeepAlive();
+    }
+  }
+
+  void
+  shrinkKeepAlive()
+  {
+    m_keepAliveS = constrainKeepAlive(m_keepAliveS / 2);
+    if (m_keepAliveS < m_sessionKeepAliveS) {
+      m_sessionKeepAliveS = m_keepAliveS;
+    }
+  }
+
+  void
+  extendKeepAlive()
+  {
+    m_keepAliveS = constrainKeepAlive(m_keepAliveS * 2);
+  }
+
+  uint16_t
+  constrainKeepAlive(uint32_t s) const
+  {
+    return s < m_minKeepAliveS ? m_minKeepAliveS : s > m_maxKeepAliveS ? m_maxKeepAliveS : s;
+  }
+
+  uint16_t m_minKeepAliveS;
+  uint16_t m_maxKeepAliveS;
+  uint16_t m_keepAliveS;
+  uint16_t m_sessionKeepAliveS;
+
+  uint32_t m_probeSeq;
+  uint32_t m_probeAckSeq;
+  bool m_probeOutstanding;
+  unsigned long m_probeSentMs;
+  /* last message sent or received, probes included */
+  unsigned long m_lastTrafficMs;
+
+  unsigned long m_lastRttMs;
+  unsigned long m_srttMs;
+  uint8_t m_consecutiveMissed;
+  uint8_t m_consecutiveGood;
+
+  int32_t m_rssiAvg;
+  int32_t m_rssiTrend;
+
+  unsigned long m_numProbes;
+  unsigned long m_numMissed;
+  unsigned long m_numReconnects;
+};
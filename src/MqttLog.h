@@ -0,0 +1,531 @@
+#pragma once
+
+#include <Arduino.h>
+
+/* Log levels, usable in preprocessor conditions */
+#define LogLevelNone  0
+#define LogLevelError 1
+#define LogLevelWarn  2
+#define LogLevelInfo  3
+#define LogLevelDebug 4
+
+/* Log statements above this level are removed at compile time */
+#ifndef MaxLogLevel
+#  define MaxLogLevel LogLevelDebug
+#endif
+
+#ifndef LogBufferSize
+#  define LogBufferSize 1024
+#endif
+
+#ifndef MaxLogSinks
+#  define MaxLogSinks 3
+#endif
+
+/* Logging macros. The tag names the module, e.g. "wifi" or "mqtt". Arguments
+ * are not evaluated if the statement is compiled out:
+ *
+ *   LOG_INFO("wifi", "connected to %s @ %d dB", ssid, WiFi.RSSI());
+ */
+#define LOG_AT(level, tag, ...) \
+  do { \
+    if ((level) <= MaxLogLevel) { \
+      logger().log((level), (tag), __VA_ARGS__); \
+    } \
+  } while (0)
+
+#define LOG_ERROR(tag, ...) LOG_AT(LogLevelError, tag, __VA_ARGS__)
+#define LOG_WARN(tag, ...)  LOG_AT(LogLevelWarn,  tag, __VA_ARGS__)
+#define LOG_INFO(tag, ...)  LOG_AT(LogLevelInfo,  tag, __VA_ARGS__)
+#define LOG_DEBUG(tag, ...) LOG_AT(LogLevelDebug, tag, __VA_ARGS__)
+
+/** Deferred formatting logger.
+ *
+ * Logging a message only copies the format string pointer, the tag pointer
+ * and the binary arguments into a ring buffer. Formatting happens later in
+ * drain(), which NetworkManager::run() calls with a small budget. Logging
+ * therefore never blocks on a slow serial or telnet sink. If the ring buffer
+ * is full, messages are dropped and counted.
+ *
+ * Format strings and tags must be string literals (or otherwise live
+ * forever). String arguments are copied (truncated to MaxStringArgLen).
+ * Supported conversions are the usual printf ones for integers, floats,
+ * characters and strings; an IPAddress can be printed with "%s".
+ */
+class Logger
+{
+public:
+  static const uint8_t MaxStringArgLen = 40;
+  static const size_t MaxEntrySize = 128;
+  static const size_t MaxLineLen = 160;
+  /* a line is written to a sink checking availableForWrite() once it
+   * reports this much space, even if the line is longer. Otherwise lines
+   * longer than the sink's transmit buffer would never be written.
+   */
+  static const int MinSinkAvailable = 64;
+
+  Logger()
+    : m_level(LogLevelInfo)
+    , m_head(0)
+    , m_tail(0)
+    , m_wrap(LogBufferSize)
+    , m_numSinks(0)
+    , m_numDropped(0)
+    , m_numReportedDropped(0)
+  { }
+
+  void
+  setLevel(uint8_t level)
+  {
+    m_level = level;
+  }
+
+  uint8_t
+  getLevel() const
+  {
+    return m_level;
+  }
+
+  /** Add a sink.
+   * @param checkAvailable If true, a line is only written if the sink's
+   * availableForWrite() reports enough space (see MinSinkAvailable). Use
+   * this for sinks which implement availableForWrite(), e.g. HardwareSerial.
+   * Others report no space at all and would hold back logging for good.
+   * @return false if already registered or no more sinks can be added
+   */
+  bool
+  addSink(Print &sink, bool checkAvailable = false)
+  {
+    if (m_numSinks >= MaxLogSinks) {
+      return false;
+    }
+    for (size_t i = 0; i < m_numSinks; i++) {
+      if (m_sinks[i].print == &sink) {
+        return false;
+      }
+    }
+    m_sinks[m_numSinks].print = &sink;
+    m_sinks[m_numSinks].checkAvailable = checkAvailable;
+    m_numSinks++;
+    return true;
+  }
+
+  bool
+  hasSink(const Print &sink) const
+  {
+    for (size_t i = 0; i < m_numSinks; i++) {
+      if (m_sinks[i].print == &sink) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /** @return true if the sink was registered */
+  bool
+  removeSink(Print &sink)
+  {
+    size_t n = 0;
+    for (size_t i = 0; i < m_numSinks; i++) {
+      if (m_sinks[i].print != &sink) {
+        m_sinks[n++] = m_sinks[i];
+      }
+    }
+    bool removed = n != m_numSinks;
+    m_numSinks = n;
+    return removed;
+  }
+
+  template <typename... Args>
+  void
+  log(uint8_t level, const char *tag, const char *fmt, Args... args)
+  {
+    if (level > m_level) {
+      return;
+    }
+
+    uint8_t entry[MaxEntrySize];
+    size_t len = 2;
+    entry[1] = level;
+    putRaw(entry, len, millis());
+    putRaw(entry, len, tag);
+    putRaw(entry, len, fmt);
+    pack(entry, len, args...);
+    entry[0] = len;
+
+    push(entry, len);
+  }
+
+  /** Format and write up to maxEntries buffered messages to all sinks.
+   * @return Number of messages written
+   */
+  size_t
+  drain(size_t maxEntries)
+  {
+    size_t n = 0;
+    while (n < maxEntries and m_tail != m_head) {
+      if (m_tail == m_wrap) {
+        m_tail = 0;
+        m_wrap = LogBufferSize;
+        continue;
+      }
+      char line[MaxLineLen];
+      size_t len = m_numReportedDropped != m_numDropped
+                 ? formatDropped(line)
+                 : format(m_buf + m_tail, line);
+
+      int needed = static_cast<int>(len) < MinSinkAvailable ? len : MinSinkAvailable;
+      for (size_t i = 0; i < m_numSinks; i++) {
+        if (m_sinks[i].checkAvailable and
+            m_sinks[i].print->availableForWrite() < needed) {
+          /* sink busy, retry on next drain */
+          return n;
+        }
+      }
+      for (size_t i = 0; i < m_numSinks; i++) {
+        m_sinks[i].print->write(reinterpret_cast<const uint8_t *>(line), len);
+      }
+
+      if (m_numReportedDropped != m_numDropped) {
+        m_numReportedDropped = m_numDropped;
+      } else {
+        m_tail += m_buf[m_tail];
+      }
+      n++;
+    }
+    return n;
+  }
+
+  /** Drain all buffered messages, e.g. before rebooting */
+  void
+  flush()
+  {
+    while (drain(16))
+      ;
+  }
+
+  unsigned long
+  numDropped() const
+  {
+    return m_numDropped;
+  }
+
+private:
+  typedef enum
+  {
+    ArgInt,
+    ArgUint,
+    ArgFloat,
+    ArgString,
+    ArgIp,
+  } ArgType;
+
+  struct Sink
+  {
+    Print *print;
+    bool checkAvailable;
+  };
+
+  /* argument packing */
+
+  template <typename T>
+  static void
+  putRaw(uint8_t *entry, size_t &len, T value)
+  {
+    if (len + sizeof(T) <= MaxEntrySize) {
+      memcpy(entry + len, &value, sizeof(T));
+      len += sizeof(T);
+    }
+  }
+
+  static void
+  pack(uint8_t *, size_t &)
+  { }
+
+  template <typename T, typename... Args>
+  static void
+  pack(uint8_t *entry, size_t &len, T value, Args... args)
+  {
+    packArg(entry, len, value);
+    pack(entry, len, args...);
+  }
+
+  static void
+  packTyped(uint8_t *entry, size_t &len, ArgType type, uint32_t bits)
+  {
+    if (len + 5 <= MaxEntrySize) {
+      entry[len++] = type;
+      putRaw(entry, len, bits);
+    }
+  }
+
+  static void packArg(uint8_t *e, size_t &l, char v)          { packTyped(e, l, ArgInt, static_cast<int32_t>(v)); }
+  static void packArg(uint8_t *e, size_t &l, int v)           { packTyped(e, l, ArgInt, static_cast<int32_t>(v)); }
+  static void packArg(uint8_t *e, size_t &l, long v)          { packTyped(e, l, ArgInt, static_cast<int32_t>(v)); }
+  static void packArg(uint8_t *e, size_t &l, unsigned int v)  { packTyped(e, l, ArgUint, v); }
+  static void packArg(uint8_t *e, size_t &l, unsigned long v) { packTyped(e, l, ArgUint, v); }
+  static void packArg(uint8_t *e, size_t &l, uint8_t v)       { packTyped(e, l, ArgUint, v); }
+  static void packArg(uint8_t *e, size_t &l, uint16_t v)      { packTyped(e, l, ArgUint, v); }
+  static void packArg(uint8_t *e, size_t &l, bool v)          { packTyped(e, l, ArgUint, v); }
+
+  static void
+  packArg(uint8_t *entry, size_t &len, double v)
+  {
+    float f = v;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    packTyped(entry, len, ArgFloat, bits);
+  }
+
+  static void
+  packArg(uint8_t *entry, size_t &len, const IPAddress &ip)
+  {
+    packTyped(entry, len, ArgIp, static_cast<uint32_t>(ip));
+  }
+
+  static void
+  packArg(uint8_t *entry, size_t &len, const String &str)
+  {
+    packArg(entry, len, str.c_str());
+  }
+
+  static void
+  packArg(uint8_t *entry, size_t &len, const char *str)
+  {
+    if (not str) {
+      str = "(null)";
+    }
+    size_t n = strlen(str);
+    if (n > MaxStringArgLen) {
+      n = MaxStringArgLen;
+    }
+    if (len + 2 + n > MaxEntrySize) {
+      return;
+    }
+    entry[len++] = ArgString;
+    entry[len++] = n;
+    memcpy(entry + len, str, n);
+    len += n;
+  }
+
+  static void
+  packArg(uint8_t *entry, size_t &len, char *str)
+  {
+    packArg(entry, len, const_cast<const char *>(str));
+  }
+
+  /* ring buffer */
+
+  void
+  push(const uint8_t *entry, size_t len)
+  {
+    if (m_head == m_tail) {
+      /* empty */
+      m_head = m_tail = 0;
+      m_wrap = LogBufferSize;
+    }
+    if (m_head >= m_tail) {
+      /* free space: [m_head, end) and [0, m_tail) */
+      if (LogBufferSize - m_head >= len) {
+        memcpy(m_buf + m_head, entry, len);
+        m_head += len;
+        return;
+      }
+      if (m_tail > len) {
+        m_wrap = m_head;
+        memcpy(m_buf, entry, len);
+        m_head = len;
+        return;
+      }
+    } else if (m_tail - m_head > len) {
+      /* free space: [m_head, m_tail) */
+      memcpy(m_buf + m_head, entry, len);
+      m_head += len;
+      return;
+    }
+    m_numDropped++;
+  }
+
+  /* formatting */
+
+  size_t
+  format(const uint8_t *entry, char *line) const
+  {
+    size_t entryLen = entry[0];
+    uint8_t level = entry[1];
+    size_t pos = 2;
+    unsigned long ms;
+    const char *tag;
+    const char *fmt;
+    getRaw(entry, pos, ms);
+    getRaw(entry, pos, tag);
+    getRaw(entry, pos, fmt);
+
+    static const char LevelChars[] = "-EWID";
+    size_t len = snprintf(line, MaxLineLen, "%lu %c %s: ", ms, LevelChars[level], tag);
+
+    while (*fmt and len < MaxLineLen - 2) {
+      if (*fmt != '%') {
+        line[len++] = *fmt++;
+        continue;
+      }
+      if (fmt[1] == '%') {
+        line[len++] = '%';
+        fmt += 2;
+        continue;
+      }
+
+      /* copy the conversion spec without length modifiers. A "*" width or
+       * precision is replaced by its argument, snprintf() below gets only
+       * the value.
+       */
+      char spec[12];
+      size_t specLen = 0;
+      spec[specLen++] = *fmt++;
+      while (*fmt and strchr("-+ #0123456789.*hlLzjt", *fmt)) {
+        if (*fmt == '*') {
+          specLen += starArg(entry, pos, entryLen, spec + specLen, sizeof(spec) - 3 - specLen);
+        } else if (not strchr("hlLzjt", *fmt) and specLen < sizeof(spec) - 3) {
+          spec[specLen++] = *fmt;
+        }
+        fmt++;
+      }
+      char conv = *fmt ? *fmt++ : 'd';
+
+      size_t room = MaxLineLen - 1 - len;
+      if (pos >= entryLen) {
+        len += snprintf(line + len, room, "?");
+      } else {
+        len += formatArg(entry, pos, spec, specLen, conv, line + len, room);
+      }
+      if (len > MaxLineLen - 2) {
+        len = MaxLineLen - 2;
+      }
+    }
+    line[len++] = '\n';
+    return len;
+  }
+
+  /** Consume the argument of a "*" width or precision and write it to spec
+   * as up to two digits. Negative values are written as 0.
+   * @return Number of characters written
+   */
+  static size_t
+  starArg(const uint8_t *entry, size_t &pos, size_t entryLen, char *spec, size_t room)
+  {
+    if (pos >= entryLen or (entry[pos] != ArgInt and entry[pos] != ArgUint)) {
+      return 0;
+    }
+    uint8_t type = entry[pos++];
+    uint32_t bits;
+    getRaw(entry, pos, bits);
+    long v = type == ArgInt ? static_cast<long>(static_cast<int32_t>(bits)) : static_cast<long>(bits);
+    v = v < 0 ? 0 : v > 99 ? 99 : v;
+    if (room < 2) {
+      return 0;
+    }
+    size_t n = 0;
+    if (v >= 10) {
+      spec[n++] = '0' + v / 10;
+    }
+    spec[n++] = '0' + v % 10;
+    return n;
+  }
+
+  static size_t
+  formatArg(const uint8_t *entry, size_t &pos, char *spec, size_t specLen, char conv, char *out, size_t room)
+  {
+    uint8_t type = entry[pos++];
+    if (type == ArgString) {
+      uint8_t n = entry[pos++];
+      char str[MaxStringArgLen + 1];
+      memcpy(str, entry + pos, n);
+      str[n] = 0;
+      pos += n;
+      spec[specLen++] = 's';
+      spec[specLen] = 0;
+      return clamp(snprintf(out, room, spec, str), room);
+    }
+
+    uint32_t bits;
+    getRaw(entry, pos, bits);
+    switch (type) {
+      case ArgFloat:
+      {
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        spec[specLen++] = strchr("eEfFgG", conv) ? conv : 'f';
+        spec[specLen] = 0;
+        return clamp(snprintf(out, room, spec, static_cast<double>(f)), room);
+      }
+      case ArgIp:
+        return clamp(snprintf(out, room, "%u.%u.%u.%u",
+                              static_cast<unsigned>(bits & 0xff),
+                              static_cast<unsigned>((bits >> 8) & 0xff),
+                              static_cast<unsigned>((bits >> 16) & 0xff),
+                              static_cast<unsigned>(bits >> 24)), room);
+      default:
+        if (not strchr("diouxXc", conv)) {
+          conv = type == ArgInt ? 'd' : 'u';
+        }
+        if (conv != 'c') {
+          spec[specLen++] = 'l';
+        }
+        spec[specLen++] = conv;
+        spec[specLen] = 0;
+        if (conv == 'c') {
+          return clamp(snprintf(out, room, spec, static_cast<int>(bits)), room);
+        }
+        if (type == ArgInt) {
+          return clamp(snprintf(out, room, spec, static_cast<long>(static_cast<int32_t>(bits))), room);
+        }
+        return clamp(snprintf(out, room, spec, static_cast<unsigned long>(bits)), room);
+    }
+  }
+
+  size_t
+  formatDropped(char *line) const
+  {
+    return snprintf(line, MaxLineLen, "%lu W log: %lu messages dropped\n",
+                    millis(), m_numDropped - m_numReportedDropped);
+  }
+
+  template <typename T>
+  static void
+  getRaw(const uint8_t *entry, size_t &pos, T &value)
+  {
+    memcpy(&value, entry + pos, sizeof(T));
+    pos += sizeof(T);
+  }
+
+  static size_t
+  clamp(int n, size_t room)
+  {
+    return n < 0 ? 0 : static_cast<size_t>(n) < room ? n : room - 1;
+  }
+
+  uint8_t m_level;
+
+  uint8_t m_buf[LogBufferSize];
+  /* entries are written at m_head and read from m_tail. If an entry does not
+   * fit at the end of the buffer, m_wrap marks the end of the valid data and
+   * writing continues at the beginning.
+   */
+  size_t m_head;
+  size_t m_tail;
+  size_t m_wrap;
+
+  Sink m_sinks[MaxLogSinks];
+  size_t m_numSinks;
+
+  unsigned long m_numDropped;
+  unsigned long m_numReportedDropped;
+};
+
+/** The logger instance used by the LOG_... macros */
+inline Logger &
+logger()
+{
+  static Logger instance;
+  return instance;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <MqttNetwork.h>
+
+/** Log sink publishing each log line as a message on "<prefix>/log".
+ *
+ *   MqttLogSink logSink(networkManager);
+ *
+ *   setup():  logSink.begin(); logger().addSink(logSink);
+ *
+ * Lines logged while the MQTT client is disconnected are discarded by this
+ * sink (other sinks still get them).
+ */
+class MqttLogSink
+  : public Print
+{
+public:
+  MqttLogSink(NetworkManager &networkManager)
+    : m_networkManager(networkManager)
+    , m_generation(0)
+    , m_len(0)
+  {
+    m_topic[0] = 0;
+  }
+
+  /** Build the log topic. It is rebuilt when the topic prefix changes, see
+   * NetworkManager::topicPrefixChanged().
+   */
+  void
+  begin()
+  {
+    m_generation = m_networkManager.topicPrefixGeneration();
+    snprintf(m_topic, sizeof(m_topic), "%s/log", m_networkManager.topicPrefix());
+  }
+
+  size_t
+  write(uint8_t c) override
+  {
+    if (c == '\n') {
+      publish(reinterpret_cast<const uint8_t *>(m_line), m_len);
+      m_len = 0;
+    } else if (m_len < sizeof(m_line)) {
+      m_line[m_len++] = c;
+    }
+    return 1;
+  }
+
+  /* The logger writes complete lines, publish those without copying */
+  size_t
+  write(const uint8_t *buffer, size_t size) override
+  {
+    if (m_len == 0 and size and buffer[size - 1] == '\n') {
+      publish(buffer, size - 1);
+      return size;
+    }
+    for (size_t i = 0; i < size; i++) {
+      write(buffer[i]);
+    }
+    return size;
+  }
+
+  using Print::write;
+
+private:
+  void
+  publish(const uint8_t *line, size_t len)
+  {
+    if (m_topic[0] and m_generation != m_networkManager.topicPrefixGeneration()) {
+      begin();
+    }
+    m_networkManager.publish(m_topic, line, len);
+  }
+
+  NetworkManager &m_networkManager;
+  /* topic prefix generation m_topic was built for */
+  uint32_t m_generation;
+  char m_topic[MaxMqttClientNameLen + 1 + 4];
+  char m_line[Logger::MaxLineLen];
+  size_t m_len;
+};
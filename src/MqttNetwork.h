@@ -1,17 +1,26 @@
 #pragma once
 
 #include <MqttFlash.h>
+#include <MqttPayload.h>
+#include <MqttLinkHealth.h>
+#include <MqttLog.h>
+#include <MqttNetworkInterface.h>
+#include <MqttStats.h>
+#include <MqttRateLimit.h>
+#include <MqttPublishFilter.h>
+#include <MqttWatchdog.h>
 
-#if defined(ARDUINO_ARCH_ESP8266)
-# include <ESP8266WiFi.h>
-# include <ESP8266mDNS.h>
-#elif defined(ARDUINO_ARCH_ESP32)
-# include <WiFi.h>
-# include <ESPmDNS.h>
-#else
+#include <PubSubClient.h>
+
+#include <new>
+
+#ifndef MaxMqttSubscriptions
+#  define MaxMqttSubscriptions 12
 #endif
 
-#include <PubSubClient.h>
+#ifndef MaxPublishFilters
+#  define MaxPublishFilters 8
+#endif
 
 /* TODO: make use of wifi callbacks!
  * mDisconnectHandler = WiFi.onStationModeDisconnected(&onDisconnected);
@@ -27,9 +36,34 @@ class NetworkManager
 public:
   /* If connection is lost, try to reconnect every minute */
   static const unsigned long ConnectRetryMs = 2 * 60UL * 1000UL;
+  /* If the MQTT connection is lost, try to reconnect every minute */
+  static const unsigned long MqttConnectRetryMs = 60 * 1000UL;
+  /* Maximum number of log messages written per run() */
+  static const size_t LogDrainBudget = 2;
+  /* Halve the publish latency histogram every ... */
+  static const unsigned long StatsDecayMs = 60 * 1000UL;
+  /* Close the telnet sessions after ... without input on any of them. A
+   * server running on request only (see requestTelnet()) is closed as well.
+   */
+  static const unsigned long TelnetIdleMs = 10 * 60 * 1000UL;
+  /* Retry publishing a stall report every ... */
+  static const unsigned long StallReportRetryMs = 10 * 1000UL;
 
   typedef void (*Callback)(void);
 
+  typedef void (*PublishTraceCallback)(const PublishTrace &trace);
+
+  /** Handler for incoming MQTT messages, see subscribe().
+   * topic and payload point into the MQTT client's buffer, which publishing
+   * overwrites. Handlers must therefore not publish, but queue replies and
+   * send them from their run() instead. Publishing from a handler fails.
+   * @param context The context pointer passed to subscribe()
+   */
+  typedef void (*MessageHandler)(void *context,
+                                 const char *topic,
+                                 const uint8_t *payload,
+                                 unsigned int length);
+
   typedef enum
   {
     StateDisconnected,
@@ -37,26 +71,116 @@ public:
     StateConnected,
   } State;
 
+  /** Construct a network manager on the WiFi station interface. The
+   * WiFiInterface is allocated here and owned by the network manager.
+   */
   NetworkManager(Print &print,
                 FlashDataMqttClient &flashData,
           TelnetClient *telnetClients,
           size_t numTelnetClients,
           Callback connectCallback = nullptr,
           Callback disconnectCallback = nullptr)
+          : NetworkManager(print,
+                           flashData,
+                           *new WiFiInterface,
+                           telnetClients,
+                           numTelnetClients,
+                           connectCallback,
+                           disconnectCallback)
+  {
+    m_ownedNet = &m_net;
+  }
+
+  /** Construct a network manager running on its own network link instead
+   * of the WiFi station interface. The link is not copied and must outlive
+   * the network manager.
+   *
+   * Links, MQTT sessions, subscriptions and statistics are per instance,
+   * but some state is shared by all instances:
+   * - the logger(): all instances log to the same LogBufferSize ring. Each
+   *   adds its Print as a sink, at most MaxLogSinks in total. Instances
+   *   sharing a Print share its sink, see setLogSink() to opt out.
+   * - the watchdog's stall record in RTC memory (StallRecordRtcBlock),
+   *   only the last stall of any instance survives a reset. Disable the
+   *   watchdog of all but one instance with getWatchdog().setBudget(0).
+   * - mDNS, if the links' startMdns() use the global responder
+   * The CLI still reads some link details from the global WiFi object.
+   * extras/host/fleet.cpp runs a fleet of instances on the host.
+   */
+  NetworkManager(Print &print,
+                 FlashDataMqttClient &flashData,
+                 NetworkInterface &networkInterface,
+                 TelnetClient *telnetClients,
+                 size_t numTelnetClients,
+                 Callback connectCallback = nullptr,
+                 Callback disconnectCallback = nullptr)
           : m_state(StateDisconnected)
           , m_connectStartMs(0)
           , m_connectTimeoutMs(10000)
           , m_print(print)
+          , m_logSink(true)
+          , m_logFlowControl(true)
           , m_flashData(flashData)
           , m_connectCallback(connectCallback)
           , m_disconnectCallback(disconnectCallback)
-          , m_telnetServer(telnetClients, numTelnetClients)
-          , m_mqttClient(m_mqttWifiClient)
-  { }
+          , m_telnetClients(telnetClients)
+          , m_numTelnetClients(numTelnetClients)
+          , m_telnetServer(nullptr)
+          , m_telnetRequested(false)
+          , m_telnetActivityMs(0)
+          , m_mdnsEnabled(true)
+          , m_mdnsRunning(false)
+          , m_ownedNet(nullptr)
+          , m_net(networkInterface)
+          , m_mqttClient(m_net.mqttTransport())
+          , m_numSubscriptions(0)
+          , m_dispatching(false)
+          , m_mqttConnectAttemptMs(0)
+          , m_mqttReconnectNow(true)
+          , m_mqttReconfigure(false)
+          , m_linkMonitoring(true)
+          , m_appliedKeepAliveS(0)
+          , m_publishTraceCallback(nullptr)
+          , m_statsDecayMs(0)
+          , m_statsIntervalMs(0)
+          , m_statsFormat(ContentFormatText)
+          , m_statsReportMs(0)
+          , m_topicPrefixGeneration(0)
+          , m_stallReportMs(0)
+          , m_localServices(true)
+          , m_directedChannel(0)
+          , m_directedBssid(nullptr)
+          , m_numPublishFilters(0)
+  {
+    m_mqttClient.setCallback([this](char *topic, uint8_t *payload, unsigned int length) {
+      dispatchMessage(topic, payload, length);
+    });
+    m_linkProbeTopic[0] = 0;
+    m_telnetTopic[0] = 0;
+    m_statsTopic[0] = 0;
+    subscribe(m_linkProbeTopic, &NetworkManager::onLinkProbe, this);
+    subscribe(m_telnetTopic, &NetworkManager::onTelnetRequest, this);
+  }
+
+  ~NetworkManager()
+  {
+    stopTelnet();
+    delete m_ownedNet;
+  }
+
+  NetworkManager(const NetworkManager &) = delete;
+  NetworkManager &operator=(const NetworkManager &) = delete;
 
   void begin()
   {
+    if (m_logSink and not logger().hasSink(m_print) and not logger().addSink(m_print, m_logFlowControl)) {
+      LOG_WARN("log", "no log sink left, raise MaxLogSinks");
+    }
+    logger().setLevel(m_flashData.debug ? LogLevelDebug : LogLevelInfo);
+    m_watchdog.begin();
+    m_watchdog.phase(PhaseWifi);
     connect();
+    m_watchdog.phase(PhaseIdle);
   }
 
   void run()
@@ -64,6 +188,7 @@ public:
     // TODO: check if connection lost and adjust state and call notifier/event system
     // TODO: if connection lost try to reconnect every now and then
 
+    m_watchdog.phase(PhaseWifi);
     switch (m_state) {
 
       case StateDisconnected:
@@ -74,26 +199,13 @@ public:
         break;
 
       case StateConnecting:
-        if (WiFi.status() == WL_CONNECTED) {
-          m_print
-            << "WiFi connected to:   " << m_flashData.wifiSsid << "\n"
-            << "signal strength:     " << WiFi.RSSI()          << " dB\n"
-            << "BSSID:               " << WiFi.BSSIDstr()      << "\n"
-            << "IP:                  " << WiFi.localIP()       << "\n"
-            #if defined(ARDUINO_ARCH_ESP8266)
-            << "host name:           " << WiFi.hostname()      << "\n"
-            #elif defined(ARDUINO_ARCH_ESP32)
-            << "host name:           " << WiFi.getHostname()   << "\n"
-            #endif
-            ;
+        if (m_net.connected()) {
+          m_net.logLinkInfo();
           if (not strlen(m_flashData.mqttServer)) {
-            m_print
-              << "MQTT server not configured or disabled\n";
+            LOG_WARN("mqtt", "server not configured or disabled");
           }
           m_state = StateConnected;
 
-          startMdns();
-
           if (m_connectCallback) {
             m_connectCallback();
           }
@@ -102,15 +214,15 @@ public:
 
         if (millis() - m_connectStartMs > m_connectTimeoutMs) {
           // Stop any pending request
-          WiFi.disconnect();
+          m_net.end();
           m_state = StateDisconnected;
-          m_print << "WiFi failed to connect to SSID \"" << m_flashData.wifiSsid << "\" -- timeout\n";
+          LOG_WARN("wifi", "failed to connect to SSID \"%s\" -- timeout", m_flashData.wifiSsid);
         }
         break;
 
       case StateConnected:
-        if (WiFi.status() != WL_CONNECTED) {
-          m_print << "WiFi connection lost\n";
+        if (not m_net.connected()) {
+          LOG_WARN("wifi", "connection lost");
           m_state = StateDisconnected;
           if (m_disconnectCallback) {
             m_disconnectCallback();
@@ -121,10 +233,26 @@ public:
         break;
     }
 
-    m_telnetServer.run();
+    m_watchdog.phase(PhaseTelnet);
+    manageTelnet();
+
+    m_watchdog.phase(PhaseMqttConnect);
+    if (m_mqttReconfigure) {
+      applyMqttConfig();
+    }
     if (manageMqtt()) {
+      m_watchdog.phase(PhaseMqttLoop);
       m_mqttClient.loop();
+      m_watchdog.phase(PhaseLinkHealth);
+      manageLinkHealth();
     }
+    m_watchdog.phase(PhaseStats);
+    manageStats();
+    manageStallReport();
+
+    m_watchdog.phase(PhaseLog);
+    logger().drain(LogDrainBudget);
+    m_watchdog.phase(PhaseIdle);
   }
 
   void
@@ -137,76 +265,192 @@ public:
     m_connectStartMs = millis();
 
     if (strlen(m_flashData.wifiSsid) == 0 or strlen(m_flashData.wifiPass) == 0) {
-      m_print << "WiFi SSID (\"" << m_flashData.wifiSsid << "\") or password (\"" << m_flashData.wifiPass << "\") not set:\n  can not connect to network.\n  please set up your SSID and password\n";
+      LOG_WARN("wifi", "SSID (\"%s\") or password (\"%s\") not set: can not connect to network. please set up your SSID and password",
+               m_flashData.wifiSsid, m_flashData.wifiPass);
 
-      printVisibleNetworks(m_print);
+      m_net.logVisibleNetworks();
 
       return;
     }
 
-    // Set WiFi mode to station (as opposed to AP or AP_STA)
-    WiFi.mode(WIFI_STA);
-#if defined(ARDUINO_ARCH_ESP8266)
-    // https://github.com/esp8266/Arduino/issues/2826
-    WiFi.hostname(myHostName());
-#endif
-    wifiBegin(m_flashData.wifiSsid,
-              m_flashData.wifiPass,
-              m_flashData.wifiRoamingEnabled);
-#if defined(ARDUINO_ARCH_ESP32)
-    WiFi.setHostname(myHostName());
-#endif
+    if (m_directedBssid) {
+      m_net.beginDirected(m_flashData.wifiSsid,
+                          m_flashData.wifiPass,
+                          m_directedChannel,
+                          m_directedBssid,
+                          myHostName());
+    } else {
+      m_net.begin(m_flashData.wifiSsid,
+                  m_flashData.wifiPass,
+                  m_flashData.wifiRoamingEnabled,
+                  myHostName());
+    }
 
     m_state = StateConnecting;
   }
   
   void
-  wifiBegin(const char *ssid, const char *pass, bool roaming)
+  disconnect()
   {
-    if (roaming) {
-      m_print << "roaming for " << ssid << ":\n";
-      byte n = WiFi.scanNetworks();
-      int32_t bestRssi = INT32_MIN;
-      int32_t bestIdx = -1;
-      for (byte i = 0; i < n; i++) {
-        if (strcmp(ssid, WiFi.SSID(i).c_str()) == 0) {
-          auto rssi = WiFi.RSSI(i);
+    if (m_state == StateDisconnected) {
+      return;
+    }
 
-          bool better = rssi > bestRssi;
+    m_net.end();
+    m_state = StateDisconnected;
 
-          m_print << (better ? " + " : " - ") << WiFi.BSSIDstr(i) << " @ " << rssi << " dB\n";
+    // invoke disconnect callback?
+  }
 
-          if (better) {
-            bestRssi = rssi;
-            bestIdx = i;
-          }
-        }
+  /** Apply changed MQTT settings (server, port, user, password, client
+   * name) without rebooting.
+   * Only the MQTT session is torn down and reconnected right away, the
+   * network link stays up. The reconnect is deferred to the next run(), so
+   * several settings changed in a row are applied with a single reconnect.
+   * Settings which are invalid (see mqttConfigError()) or do not fit
+   * together (see mqttLoginError()) are logged and the current session is
+   * kept.
+   */
+  void
+  reconfigureMqtt()
+  {
+    m_mqttReconfigure = true;
+  }
+
+  /** Check an MQTT server name before storing it
+   * @return What is wrong or nullptr if valid
+   */
+  static const char *
+  mqttServerError(const char *server)
+  {
+    size_t len = strnlen(server, MaxMqttServerNameLen + 1);
+    if (len > MaxMqttServerNameLen) {
+      return "server name too long";
+    }
+    for (size_t i = 0; i < len; i++) {
+      char c = server[i];
+      if (not isalnum(static_cast<unsigned char>(c)) and not strchr(".-_:", c)) {
+        return "invalid character in server name";
       }
-      if (bestIdx >= 0) {
-        WiFi.begin(ssid,
-                   pass,
-                   0 /* channel */,
-                   WiFi.BSSID(bestIdx));
-        return;
+    }
+    return nullptr;
+  }
+
+  /** Check an MQTT client name before storing it
+   * @return What is wrong or nullptr if valid
+   */
+  static const char *
+  mqttClientNameError(const char *client)
+  {
+    size_t len = strnlen(client, MaxMqttClientNameLen + 1);
+    if (len > MaxMqttClientNameLen) {
+      return "client name too long";
+    }
+    for (size_t i = 0; i < len; i++) {
+      /* the client name is used as topic prefix */
+      if (static_cast<unsigned char>(client[i]) <= ' ' or strchr("+#/", client[i])) {
+        return "invalid character in client name";
       }
-      m_print << "network not found - falling back to regular operation\n";
-      // No entry found in scan list, falling back to non-roaming
     }
+    return nullptr;
+  }
+
+  /** Check the MQTT settings in flash, settings with which no connection
+   * can be attempted at all
+   * @return What is wrong or nullptr if the settings are valid
+   */
+  const char *
+  mqttConfigError() const
+  {
+    const char *error = mqttServerError(m_flashData.mqttServer);
+    if (error) {
+      return error;
+    }
+    if (m_flashData.mqttServer[0] and m_flashData.mqttPort == 0) {
+      return "invalid port 0";
+    }
+    return mqttClientNameError(m_flashData.mqttClientName);
+  }
 
-    WiFi.begin(ssid, pass);
+  /** Check if the MQTT settings in flash fit together. Several settings
+   * changed in a row (e.g. a CLI batch) are checked once they have all been
+   * made, see reconfigureMqtt().
+   * @return What is wrong or nullptr if the settings are consistent
+   */
+  const char *
+  mqttLoginError() const
+  {
+    if (not m_flashData.mqttClientName[0] and (m_flashData.mqttUser[0] or m_flashData.mqttPass[0])) {
+      return "client name required for login";
+    }
+    return nullptr;
   }
 
+  /** En-/disable the local services (mDNS and telnet), e.g. on battery
+   * powered devices nobody logs in to. When enabled, the telnet server runs
+   * while enabled in the flash settings or requested, see requestTelnet().
+   */
   void
-  disconnect()
+  setLocalServices(bool enable)
   {
-    if (m_state == StateDisconnected) {
-      return;
+    m_localServices = enable;
+  }
+
+  /** Start the telnet server even if disabled in the flash settings. Unless
+   * enabled there in the meantime it is closed again once idle for
+   * TelnetIdleMs. Telnet can be requested over MQTT as well by publishing
+   * "on" (or "off") to "<prefix>/$SYS/telnet".
+   */
+  void
+  requestTelnet(bool request = true)
+  {
+    m_telnetRequested = request;
+  }
+
+  bool
+  telnetRunning() const
+  {
+    return m_telnetServer;
+  }
+
+  /** Note input read from stream. Input from a telnet session keeps the
+   * telnet server from being closed for idleness. Called by the CLI before
+   * it consumes input.
+   */
+  void
+  inputActivity(const Stream &stream)
+  {
+    for (size_t i = 0; i < m_numTelnetClients; i++) {
+      if (&stream == &m_telnetClients[i]) {
+        m_telnetActivityMs = millis();
+        return;
+      }
     }
+  }
 
-    WiFi.disconnect();
-    m_state = StateDisconnected;
+  /** En-/disable announcing the host name and telnet service by mDNS while
+   * the telnet server runs
+   */
+  void
+  setMdnsEnabled(bool enable)
+  {
+    m_mdnsEnabled = enable;
+    if (not enable) {
+      stopMdns();
+    } else if (m_telnetServer and not m_mdnsRunning) {
+      startMdns();
+    }
+  }
 
-    // invoke disconnect callback?
+  /** Join a known access point on the next connect() without scanning.
+   * @param bssid The access point's BSSID, must remain valid. nullptr
+   * restores the regular (roaming) connect.
+   */
+  void
+  setDirectedJoin(int32_t channel, const uint8_t *bssid)
+  {
+    m_directedChannel = channel;
+    m_directedBssid = bssid;
   }
 
   State
@@ -221,16 +465,10 @@ public:
     return m_state == StateConnected;
   }
 
-  static void
+  void
   printVisibleNetworks(Print& print)
   {
-    byte n = WiFi.scanNetworks();
-    if (n) {
-      print << "visible network SSIDs:\n";
-      for (int i = 0; i < n; i++) {
-        print << "  " << WiFi.SSID(i) << " (" << WiFi.RSSI(i) << " dB)\n";
-      }
-    }
+    m_net.printVisibleNetworks(print);
   }
 
   PubSubClient &
@@ -239,16 +477,399 @@ public:
     return m_mqttClient;
   }
 
+  NetworkInterface &
+  getNetworkInterface()
+  {
+    return m_net;
+  }
+
+  /** Publish a message.
+   * Messages too large for the MQTT client's buffer are streamed.
+   * @param priority Priority for rate limiting, see PublishRateLimiter
+   * @return true if the message has been handed over to the MQTT client or
+   * suppressed as unchanged (see setPublishFilter()), false if not
+   * connected, rate limited or writing failed. Nothing is suppressed while
+   * not connected, so a false return always means the message was lost.
+   */
+  bool
+  publish(const char *topic,
+          const uint8_t *payload,
+          unsigned int length,
+          bool retained = false,
+          PublishPriority priority = PriorityTelemetry)
+  {
+    return publishFiltered(findPublishFilter(topic), topic, payload, length, retained, priority)
+      != ResultFailed;
+  }
+
+  /** Publish a numeric value as text. If the topic has a publish filter
+   * with a deadband, values within the deadband are suppressed.
+   * @return see publish()
+   */
+  bool
+  publishValue(const char *topic,
+               float value,
+               uint8_t decimals = 2,
+               bool retained = false,
+               PublishPriority priority = PriorityTelemetry)
+  {
+    PublishFilter *filter = findPublishFilter(topic);
+    if (filter and m_mqttClient.connected() and filter->withinDeadband(value, millis())) {
+      filter->suppressed();
+      m_stats.numSuppressed++;
+      return true;
+    }
+
+    uint8_t buf[24];
+    PayloadWriter w(ContentFormatText, buf, sizeof(buf));
+    w.value(value, decimals);
+    if (not w.ok()) {
+      return false;
+    }
+    PublishResult result = publishFiltered(filter, topic, w.data(), w.size(), retained, priority);
+    if (filter and result == ResultSent) {
+      filter->sentValue(value);
+    }
+    return result != ResultFailed;
+  }
+
+  /** Publish only changed messages on a topic.
+   * Identical payloads are suppressed, values published by publishValue()
+   * additionally within the deadband. After maxSilenceMs without sending,
+   * the next message is sent regardless as a heartbeat. The filter starts
+   * over on every MQTT connect. Streamed messages are not filtered.
+   * Reconfiguring a topic resets its counters.
+   * @param topic Topic, identified by its hash (see topicHash())
+   * @return false if the filter table is full
+   */
+  bool
+  setPublishFilter(const char *topic,
+                   DeadbandMode mode = DeadbandNone,
+                   float deadband = 0,
+                   unsigned long maxSilenceMs = PublishFilter::DefaultMaxSilenceMs)
+  {
+    uint32_t hash = topicHash(topic);
+    PublishFilterEntry *entry = nullptr;
+    for (size_t i = 0; i < m_numPublishFilters; i++) {
+      if (m_publishFilters[i].topicHash == hash) {
+        entry = &m_publishFilters[i];
+        break;
+      }
+    }
+    if (not entry) {
+      if (m_numPublishFilters >= MaxPublishFilters) {
+        LOG_ERROR("mqtt", "publish filter table full, can not add %s", topic);
+        return false;
+      }
+      entry = &m_publishFilters[m_numPublishFilters++];
+      entry->topicHash = hash;
+    }
+    entry->filter.configure(mode, deadband, maxSilenceMs);
+    return true;
+  }
+
+  /** The publish filter of a topic, e.g. to read its counters. nullptr if
+   * the topic is not filtered.
+   */
+  const PublishFilter *
+  getPublishFilter(const char *topic)
+  {
+    return findPublishFilter(topic);
+  }
+
+  bool
+  publish(const char *topic,
+          const char *payload,
+          bool retained = false,
+          PublishPriority priority = PriorityTelemetry)
+  {
+    return publish(topic, reinterpret_cast<const uint8_t *>(payload), strlen(payload), retained, priority);
+  }
+
+  bool
+  publish(const char *topic,
+          const PayloadWriter &payload,
+          bool retained = false,
+          PublishPriority priority = PriorityTelemetry)
+  {
+    if (not payload.ok()) {
+      return false;
+    }
+    return publish(topic, payload.data(), payload.size(), retained, priority);
+  }
+
+  /** Subscribe to an MQTT topic filter.
+   * The subscription is kept across reconnects. Incoming messages matching
+   * the filter are passed to the handler. Use this instead of setting a
+   * callback on the MQTT client directly. Handlers must not publish, see
+   * MessageHandler.
+   * @param filter Topic filter, may contain the wildcards "+" and "#". The
+   * string is not copied and must remain valid.
+   * @return false if the subscription table is full
+   */
+  bool
+  subscribe(const char *filter, MessageHandler handler, void *context = nullptr, uint8_t qos = 0)
+  {
+    if (m_numSubscriptions >= MaxMqttSubscriptions) {
+      LOG_ERROR("mqtt", "subscription table full, can not subscribe to %s", filter);
+      return false;
+    }
+    Subscription &sub = m_subscriptions[m_numSubscriptions++];
+    sub.filter = filter;
+    sub.handler = handler;
+    sub.context = context;
+    sub.qos = qos;
+
+    if (m_mqttClient.connected()) {
+      m_mqttClient.subscribe(filter, qos);
+    }
+    return true;
+  }
+
+  /** Remove all subscriptions registered for handler with context */
+  void
+  unsubscribe(MessageHandler handler, void *context = nullptr)
+  {
+    size_t n = 0;
+    for (size_t i = 0; i < m_numSubscriptions; i++) {
+      Subscription &sub = m_subscriptions[i];
+      if (sub.handler == handler and sub.context == context) {
+        if (m_mqttClient.connected()) {
+          m_mqttClient.unsubscribe(sub.filter);
+        }
+        continue;
+      }
+      m_subscriptions[n++] = sub;
+    }
+    m_numSubscriptions = n;
+  }
+
+  /** Check if an MQTT topic matches a topic filter with "+" and "#"
+   * wildcards.
+   */
+  static bool
+  topicMatches(const char *filter, const char *topic)
+  {
+    while (*filter) {
+      if (*filter == '#') {
+        return true;
+      }
+      if (*filter == '+') {
+        while (*topic and *topic != '/') {
+          topic++;
+        }
+        filter++;
+        continue;
+      }
+      if (*filter != *topic) {
+        /* "a/#" matches "a" as well */
+        return *topic == 0 and filter[0] == '/' and filter[1] == '#' and filter[2] == 0;
+      }
+      filter++;
+      topic++;
+    }
+    return *topic == 0;
+  }
+
+  /** Prefix for this device's topics: the MQTT client name or the host name
+   * if no client name is configured.
+   */
+  const char *
+  topicPrefix()
+  {
+    return strlen(m_flashData.mqttClientName) ? m_flashData.mqttClientName : myHostName();
+  }
+
+  /** Must be called after the MQTT client name or the host name changed.
+   * Invalidates topics derived from topicPrefix(): MqttTopics, MqttCliStream,
+   * MqttOta and MqttLogSink rebuild theirs.
+   */
+  void
+  topicPrefixChanged()
+  {
+    m_topicPrefixGeneration++;
+  }
+
+  /** Incremented whenever the topic prefix changes */
+  uint32_t
+  topicPrefixGeneration() const
+  {
+    return m_topicPrefixGeneration;
+  }
+
+  /** Publish a message by encoding it directly into the MQTT client's
+   * streaming publish path. No payload buffer is needed and the payload size
+   * is not limited by the MQTT client's buffer size.
+   *
+   * The encoder is invoked twice with a PayloadWriter: once to determine
+   * the payload length and once to stream the payload. It must therefore
+   * produce the same output on both invocations:
+   *
+   *   networkManager.publishStreamed("sensor/env", ContentFormatCbor,
+   *     [&](PayloadWriter &w) {
+   *       w.beginObject().field("t", t).field("h", h).endObject();
+   *     });
+   */
+  template <typename Encoder>
+  bool
+  publishStreamed(const char *topic,
+                  ContentFormat format,
+                  Encoder encode,
+                  bool retained = false,
+                  PublishPriority priority = PriorityTelemetry)
+  {
+    PublishTrace trace;
+    trace.topic = topic;
+    trace.length = 0;
+    trace.enqueuedUs = micros();
+    trace.ok = false;
+
+    if (m_mqttClient.connected() and publishAllowed(topic)) {
+      PayloadWriter counter(format);
+      encode(counter);
+      trace.length = counter.size();
+
+      if (not m_rateLimiter.admit(priority, counter.size())) {
+        return false;
+      }
+      if (m_mqttClient.beginPublish(topic, counter.size(), retained)) {
+        PayloadWriter writer(format, m_mqttClient);
+        encode(writer);
+        trace.ok = m_mqttClient.endPublish() and writer.ok();
+      }
+    }
+
+    trace.writtenUs = micros();
+    recordPublish(trace);
+    return trace.ok;
+  }
+
+  const MqttStats &
+  getStats() const
+  {
+    return m_stats;
+  }
+
+  /** Rate limiter in front of the publish path, use it to configure the
+   * limits
+   */
+  PublishRateLimiter &
+  getRateLimiter()
+  {
+    return m_rateLimiter;
+  }
+
+  /** Software watchdog of the loop, see StallWatchdog */
+  StallWatchdog &
+  getWatchdog()
+  {
+    return m_watchdog;
+  }
+
+  void
+  resetStats()
+  {
+    m_stats.reset();
+    for (size_t i = 0; i < m_numPublishFilters; i++) {
+      m_publishFilters[i].filter.resetCounters();
+    }
+    m_rateLimiter.reset();
+  }
+
+  /** Install a callback receiving the timestamps of every published
+   * message, e.g. for detailed tracing. Pass nullptr to remove it.
+   */
+  void
+  setPublishTraceCallback(PublishTraceCallback callback)
+  {
+    m_publishTraceCallback = callback;
+  }
+
+  /** Periodically publish the statistics on "<prefix>/$SYS/stats".
+   * @param intervalMs Reporting interval, 0 disables reporting
+   */
+  void
+  setStatsReporting(unsigned long intervalMs, ContentFormat format = ContentFormatText)
+  {
+    m_statsIntervalMs = intervalMs;
+    m_statsFormat = format;
+  }
+
   const char * myHostName()
   {
     const char* hostName = m_flashData.hostName;
     if (strlen(hostName) == 0) {
-      m_print << "host name with length zero detected. defaulting to \"" << DefaultHostName << "\"\n";
+      LOG_WARN("wifi", "host name with length zero detected. defaulting to \"%s\"", DefaultHostName);
       hostName = DefaultHostName;
     }
     return hostName;
   }
 
+  const LinkHealth &
+  getLinkHealth() const
+  {
+    return m_linkHealth;
+  }
+
+  /** Send a link probe now, superseding one on its way. Once it has
+   * returned (see LinkHealth::probeAckSeq()) all messages published before
+   * have been received by the broker. Probes bypass the rate limiter and
+   * are not counted in the statistics.
+   * @return The probe's sequence number
+   */
+  uint32_t
+  sendProbe()
+  {
+    uint32_t seq = m_linkHealth.probeSent(millis(), m_net.rssi());
+    char payload[12];
+    int len = snprintf(payload, sizeof(payload), "%lu", static_cast<unsigned long>(seq));
+    if (publishAllowed(m_linkProbeTopic)) {
+      writeMessage(m_linkProbeTopic, reinterpret_cast<const uint8_t *>(payload), len, false);
+    }
+    return seq;
+  }
+
+  /** En-/disable logging to the Print passed to the constructor (enabled
+   * by default). Takes effect with begin().
+   */
+  void
+  setLogSink(bool enable)
+  {
+    m_logSink = enable;
+  }
+
+  /** En-/disable flow control of the log output to the Print passed to the
+   * constructor (enabled by default). With flow control, log lines are only
+   * written once the Print's availableForWrite() reports room, so draining
+   * the log never blocks on a full serial transmit buffer. Disable it if
+   * the Print does not implement availableForWrite().
+   */
+  void
+  setLogFlowControl(bool enable)
+  {
+    m_logFlowControl = enable;
+    if (logger().removeSink(m_print)) {
+      logger().addSink(m_print, m_logFlowControl);
+    }
+  }
+
+  /** En-/disable link health monitoring by MQTT probes. When disabled the
+   * keep alive interval is fixed at the lower bound set by
+   * setKeepAliveBounds() and dead links are detected by the MQTT client's
+   * pings only.
+   */
+  void
+  setLinkMonitoring(bool enable)
+  {
+    m_linkMonitoring = enable;
+  }
+
+  void
+  setKeepAliveBounds(uint16_t minS, uint16_t maxS)
+  {
+    m_linkHealth.setKeepAliveBounds(minS, maxS);
+  }
+
   void setConnectCallback(Callback connectCallback)
   {
      m_connectCallback = connectCallback;
@@ -264,14 +885,129 @@ private:
   {
     const char *hn = myHostName();
 
-    if (!MDNS.begin(hn)) {
-      m_print.println("Error setting up MDNS responder!");
+    if (not m_net.startMdns(hn)) {
+      LOG_ERROR("mdns", "error setting up MDNS responder");
     } else {
-      MDNS.addService("telnet", "tcp", 23);
-      m_print << "published telnet host name: " << hn << "\n";
+      LOG_INFO("mdns", "published telnet host name: %s", hn);
+      m_mdnsRunning = true;
     }
   }
 
+  /** Run the telnet server (and mDNS) only while needed. The server is
+   * constructed in place on demand and destroyed again, so it holds no
+   * sockets or buffers while off.
+   */
+  void
+  manageTelnet()
+  {
+    bool wanted = m_localServices and
+                  m_state == StateConnected and
+                  (m_flashData.telnetEnabled or m_telnetRequested);
+    if (wanted and not m_telnetServer) {
+      m_telnetServer = new (m_telnetStorage) TelnetServer(m_telnetClients, m_numTelnetClients);
+      m_telnetActivityMs = millis();
+      LOG_INFO("telnet", "server started");
+      if (m_mdnsEnabled) {
+        startMdns();
+      }
+    } else if (not wanted and m_telnetServer) {
+      stopTelnet();
+    }
+    if (not m_telnetServer) {
+      return;
+    }
+
+    m_telnetServer->run();
+
+    /* input consumed by a CLI is reported by inputActivity(), this catches
+     * input nobody reads
+     */
+    unsigned long now = millis();
+    for (size_t i = 0; i < m_numTelnetClients; i++) {
+      if (m_telnetClients[i].available() > 0) {
+        m_telnetActivityMs = now;
+      }
+    }
+    if (now - m_telnetActivityMs > TelnetIdleMs) {
+      /* a server enabled in flash keeps running (and announced by mDNS),
+       * one started by requestTelnet() only is done
+       */
+      m_telnetActivityMs = now;
+      m_telnetRequested = false;
+      if (m_flashData.telnetEnabled) {
+        LOG_DEBUG("telnet", "idle, closing sessions");
+        closeTelnetSessions();
+      } else {
+        LOG_INFO("telnet", "idle, closing server");
+        stopTelnet();
+      }
+    }
+  }
+
+  void
+  closeTelnetSessions()
+  {
+    /* the sessions belong to the sketch, close them here instead of
+     * relying on the server to do so
+     */
+    for (size_t i = 0; i < m_numTelnetClients; i++) {
+      m_telnetClients[i].stop();
+    }
+  }
+
+  void
+  stopTelnet()
+  {
+    if (m_telnetServer) {
+      closeTelnetSessions();
+      m_telnetServer->~TelnetServer();
+      m_telnetServer = nullptr;
+      LOG_INFO("telnet", "server stopped");
+    }
+    stopMdns();
+  }
+
+  void
+  stopMdns()
+  {
+    if (m_mdnsRunning) {
+      m_net.stopMdns();
+      m_mdnsRunning = false;
+    }
+  }
+
+  static void
+  onTelnetRequest(void *context, const char *, const uint8_t *payload, unsigned int length)
+  {
+    NetworkManager *self = static_cast<NetworkManager *>(context);
+    if (length == 2 and memcmp(payload, "on", 2) == 0) {
+      self->requestTelnet(true);
+    } else if (length == 3 and memcmp(payload, "off", 3) == 0) {
+      self->requestTelnet(false);
+    }
+  }
+
+  void
+  applyMqttConfig()
+  {
+    m_mqttReconfigure = false;
+
+    const char *error = mqttConfigError();
+    if (not error) {
+      error = mqttLoginError();
+    }
+    if (error) {
+      LOG_ERROR("mqtt", "%s, keeping current session", error);
+      return;
+    }
+
+    if (m_mqttClient.connected()) {
+      LOG_INFO("mqtt", "settings changed, reconnecting");
+      m_mqttClient.disconnect();
+    }
+    m_mqttReconnectNow = true;
+  }
+
   bool
   manageMqtt()
   {
@@ -286,49 +1022,372 @@ private:
     /* Network connected but MQTT not connected - (re-) connect ... */
 
     /* Limit reconnect attempts */
-    const unsigned long ConnectRetryMs = 60 * 1000;
-    static unsigned long lastConnectAttemptMs = millis() - 2 * ConnectRetryMs;
-    if (millis() - lastConnectAttemptMs < ConnectRetryMs) {
+    if (not m_mqttReconnectNow and millis() - m_mqttConnectAttemptMs < MqttConnectRetryMs) {
       return false;
     }
-    lastConnectAttemptMs = millis();
+    m_mqttReconnectNow = false;
+    m_mqttConnectAttemptMs = millis();
 
     if (not strlen(m_flashData.mqttServer)) {
-//      Log << "MQTT server not configured\n";
+      LOG_DEBUG("mqtt", "server not configured");
+      return false;
+    }
+    const char *error = mqttConfigError();
+    if (error) {
+      LOG_ERROR("mqtt", "%s, not connecting", error);
       return false;
     }
+    /* the broker decides, it may well accept the login */
+    error = mqttLoginError();
+    if (error) {
+      LOG_WARN("mqtt", "%s", error);
+    }
 
     m_mqttClient.setServer(m_flashData.mqttServer, m_flashData.mqttPort);
 
-    m_print.print("Attempting MQTT connection...");
+    snprintf(m_linkProbeTopic, sizeof(m_linkProbeTopic), "%s/$link", topicPrefix());
+    snprintf(m_telnetTopic, sizeof(m_telnetTopic), "%s/$SYS/telnet", topicPrefix());
+    snprintf(m_statsTopic, sizeof(m_statsTopic), "%s/$SYS/stats", topicPrefix());
+    uint16_t keepAliveS = m_linkMonitoring
+                        ? m_linkHealth.keepAliveS()
+                        : m_linkHealth.minKeepAliveS();
+    m_mqttClient.setKeepAlive(keepAliveS);
+    m_appliedKeepAliveS = keepAliveS;
+
+    LOG_INFO("mqtt", "attempting connection to %s:%u", m_flashData.mqttServer, m_flashData.mqttPort);
 
     if (m_mqttClient.connect(m_flashData.mqttClientName,
                            m_flashData.mqttUser,
                            m_flashData.mqttPass)) {
-      m_print.println("MQTT connected");
+      LOG_INFO("mqtt", "connected, keep alive %u s", keepAliveS);
+      m_linkHealth.reset(millis(), keepAliveS);
+      for (size_t i = 0; i < m_numPublishFilters; i++) {
+        m_publishFilters[i].filter.invalidate();
+      }
+      for (size_t i = 0; i < m_numSubscriptions; i++) {
+        m_mqttClient.subscribe(m_subscriptions[i].filter, m_subscriptions[i].qos);
+      }
       return true;
     } else {
-      m_print.print("failed, rc = ");
-      m_print.print(m_mqttClient.state());
-      m_print.println(", retrying later");
+      LOG_WARN("mqtt", "connection failed, rc = %d, retrying later", m_mqttClient.state());
+      return false;
+    }
+  }
+
+  typedef enum
+  {
+    ResultSent,
+    ResultSuppressed,
+    ResultFailed,
+  } PublishResult;
+
+  PublishFilter *
+  findPublishFilter(const char *topic)
+  {
+    if (not m_numPublishFilters) {
+      return nullptr;
+    }
+    uint32_t hash = topicHash(topic);
+    for (size_t i = 0; i < m_numPublishFilters; i++) {
+      if (m_publishFilters[i].topicHash == hash) {
+        return &m_publishFilters[i].filter;
+      }
+    }
+    return nullptr;
+  }
+
+  PublishResult
+  publishFiltered(PublishFilter *filter,
+                  const char *topic,
+                  const uint8_t *payload,
+                  unsigned int length,
+                  bool retained,
+                  PublishPriority priority)
+  {
+    if (not publishAllowed(topic)) {
+      return ResultFailed;
+    }
+
+    /* while not connected the message fails below, even if unchanged */
+    uint32_t hash = 0;
+    if (filter and m_mqttClient.connected()) {
+      hash = fnv1aHash(payload, length);
+      if (filter->repeats(hash, millis())) {
+        filter->suppressed();
+        m_stats.numSuppressed++;
+        return ResultSuppressed;
+      }
+    }
+
+    PublishTrace trace;
+    trace.topic = topic;
+    trace.length = length;
+    trace.enqueuedUs = micros();
+    trace.ok = false;
+
+    /* check the connection first, a message which can not be sent must
+     * not use up rate limit tokens
+     */
+    if (m_mqttClient.connected()) {
+      if (not m_rateLimiter.admit(priority, length)) {
+        return ResultFailed;
+      }
+      trace.ok = writeMessage(topic, payload, length, retained);
+    }
+    trace.writtenUs = micros();
+    recordPublish(trace);
+
+    if (not trace.ok) {
+      return ResultFailed;
+    }
+    if (filter) {
+      filter->sent(hash, millis());
+    }
+    return ResultSent;
+  }
+
+  bool
+  writeMessage(const char *topic, const uint8_t *payload, unsigned int length, bool retained)
+  {
+    if (not m_mqttClient.connected()) {
       return false;
     }
+    if (length + strlen(topic) + MQTT_MAX_HEADER_SIZE + 2 > m_mqttClient.getBufferSize()) {
+      /* too large for the client's buffer - stream it instead */
+      return m_mqttClient.beginPublish(topic, length, retained)
+        and m_mqttClient.write(payload, length) == length
+        and m_mqttClient.endPublish();
+    }
+    return m_mqttClient.publish(topic, payload, length, retained);
+  }
+
+  void
+  recordPublish(const PublishTrace &trace)
+  {
+    if (trace.ok) {
+      m_linkHealth.traffic(millis());
+    }
+    m_stats.recordPublish(trace);
+    if (m_publishTraceCallback) {
+      m_publishTraceCallback(trace);
+    }
   }
 
+  void
+  manageStats()
+  {
+    unsigned long now = millis();
+    if (now - m_statsDecayMs >= StatsDecayMs) {
+      m_statsDecayMs = now;
+      m_stats.publishLatency.decay();
+    }
+
+    if (not m_statsIntervalMs or
+        now - m_statsReportMs < m_statsIntervalMs or
+        not m_mqttClient.connected()) {
+      return;
+    }
+    m_statsReportMs = now;
+
+    const MqttStats &st = m_stats;
+    uint8_t buf[256];
+    PayloadWriter w(m_statsFormat, buf, sizeof(buf));
+    w.beginObject()
+      .field("pub", st.numPublished)
+      .field("pubFail", st.numPublishFailed)
+      .field("pubBytes", st.bytesPublished)
+      .field("rcv", st.numReceived)
+      .field("rcvBytes", st.bytesReceived)
+      .field("p50Us", st.publishLatency.percentileUs(50))
+      .field("p90Us", st.publishLatency.percentileUs(90))
+      .field("p99Us", st.publishLatency.percentileUs(99))
+      .field("maxUs", st.maxPublishUs)
+      .field("supp", st.numSuppressed)
+      .field("rttMs", m_linkHealth.smoothedRttMs())
+      .field("rssi", static_cast<long>(m_net.rssi()))
+      .endObject();
+    publish(m_statsTopic, w);
+  }
+
+  /** Publish a stall recorded by the watchdog on "<prefix>/$SYS/stall" */
+  void
+  manageStallReport()
+  {
+    unsigned long now = millis();
+    if (not m_mqttClient.connected() or now - m_stallReportMs < StallReportRetryMs) {
+      return;
+    }
+    StallRecord record;
+    if (not m_watchdog.pending(record)) {
+      return;
+    }
+    m_stallReportMs = now;
+
+    char topic[MaxMqttClientNameLen + 1 + 11];
+    snprintf(topic, sizeof(topic), "%s/$SYS/stall", topicPrefix());
+
+    uint8_t buf[128];
+    PayloadWriter w(ContentFormatText, buf, sizeof(buf));
+    w.beginObject()
+      .field("phase", loopPhaseName(static_cast<LoopPhase>(record.phase)))
+      .field("detail", record.detail)
+      .field("ms", static_cast<unsigned long>(record.durationMs))
+      .field("at", static_cast<unsigned long>(record.startMs))
+      .field("reset", record.unfinished != 0)
+      .endObject();
+    if (publish(topic, w, false, PriorityAlarm)) {
+      m_watchdog.reported();
+    }
+  }
+
+  /** Probe the link and act on the link's health, see LinkHealth */
+  void
+  manageLinkHealth()
+  {
+    if (not m_linkMonitoring or not m_mqttClient.connected()) {
+      return;
+    }
+
+    switch (m_linkHealth.run(millis())) {
+      case LinkHealth::ActionProbe:
+        sendProbe();
+        break;
+      case LinkHealth::ActionReconnect:
+        LOG_WARN("mqtt", "link probes missed, reconnecting");
+        m_mqttClient.disconnect();
+        m_mqttReconnectNow = true;
+        return;
+      case LinkHealth::ActionNone:
+        break;
+    }
+
+    /* shortened keep alive intervals apply immediately */
+    if (m_linkHealth.sessionKeepAliveS() != m_appliedKeepAliveS) {
+      m_appliedKeepAliveS = m_linkHealth.sessionKeepAliveS();
+      m_mqttClient.setKeepAlive(m_appliedKeepAliveS);
+    }
+  }
+
+  static void
+  onLinkProbe(void *context, const char *, const uint8_t *payload, unsigned int length)
+  {
+    char buf[12];
+    if (length >= sizeof(buf)) {
+      return;
+    }
+    memcpy(buf, payload, length);
+    buf[length] = 0;
+    NetworkManager *self = static_cast<NetworkManager *>(context);
+    self->m_linkHealth.probeReceived(strtoul(buf, nullptr, 10), millis());
+  }
+
+  void
+  dispatchMessage(const char *topic, const uint8_t *payload, unsigned int length)
+  {
+    m_linkHealth.traffic(millis());
+    if (strcmp(topic, m_linkProbeTopic) != 0) {
+      m_stats.recordReceive(length);
+    }
+    m_dispatching = true;
+    for (size_t i = 0; i < m_numSubscriptions; i++) {
+      const Subscription &sub = m_subscriptions[i];
+      if (topicMatches(sub.filter, topic)) {
+        sub.handler(sub.context, topic, payload, length);
+      }
+    }
+    m_dispatching = false;
+  }
+
+  /** Publishing from a message handler would overwrite the message being
+   * dispatched, see MessageHandler
+   */
+  bool
+  publishAllowed(const char *topic)
+  {
+    if (m_dispatching) {
+      LOG_ERROR("mqtt", "publish to %s from message handler refused", topic);
+      return false;
+    }
+    return true;
+  }
+
+  struct Subscription
+  {
+    const char *filter;
+    MessageHandler handler;
+    void *context;
+    uint8_t qos;
+  };
+
   State m_state;
   unsigned long m_connectStartMs;
   unsigned long m_connectTimeoutMs;
 
   Print &m_print;
+  bool m_logSink;
+  bool m_logFlowControl;
   FlashDataMqttClient &m_flashData;
 
   Callback m_connectCallback;
   Callback m_disconnectCallback;
 
-  TelnetServer m_telnetServer;
+  TelnetClient *m_telnetClients;
+  size_t m_numTelnetClients;
+  /* constructed in m_telnetStorage while running, see manageTelnet() */
+  TelnetServer *m_telnetServer;
+  alignas(TelnetServer) uint8_t m_telnetStorage[sizeof(TelnetServer)];
+  bool m_telnetRequested;
+  unsigned long m_telnetActivityMs;
+  char m_telnetTopic[MaxMqttClientNameLen + 1 + 12];
+  bool m_mdnsEnabled;
+  bool m_mdnsRunning;
 
-  WiFiClient m_mqttWifiClient;
+  /* the default WiFi link if allocated by the constructor, else nullptr */
+  NetworkInterface *m_ownedNet;
+  NetworkInterface &m_net;
   PubSubClient m_mqttClient;
+
+  Subscription m_subscriptions[MaxMqttSubscriptions];
+  size_t m_numSubscriptions;
+  /* a message is being passed to the handlers */
+  bool m_dispatching;
+
+  unsigned long m_mqttConnectAttemptMs;
+  /* skip the retry delay on the next MQTT connect */
+  bool m_mqttReconnectNow;
+  /* MQTT settings changed, see reconfigureMqtt() */
+  bool m_mqttReconfigure;
+
+  LinkHealth m_linkHealth;
+  bool m_linkMonitoring;
+  uint16_t m_appliedKeepAliveS;
+  char m_linkProbeTopic[MaxMqttClientNameLen + 1 + 6];
+
+  MqttStats m_stats;
+  PublishRateLimiter m_rateLimiter;
+  PublishTraceCallback m_publishTraceCallback;
+  unsigned long m_statsDecayMs;
+  unsigned long m_statsIntervalMs;
+  ContentFormat m_statsFormat;
+  unsigned long m_statsReportMs;
+  char m_statsTopic[MaxMqttClientNameLen + 1 + 11];
+
+  uint32_t m_topicPrefixGeneration;
+
+  StallWatchdog m_watchdog;
+  unsigned long m_stallReportMs;
+
+  bool m_localServices;
+  int32_t m_directedChannel;
+  const uint8_t *m_directedBssid;
+
+  struct PublishFilterEntry
+  {
+    uint32_t topicHash;
+    PublishFilter filter;
+  };
+  PublishFilterEntry m_publishFilters[MaxPublishFilters];
+  size_t m_numPublishFilters;
 };
 
 
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <MqttLog.h>
+
+#if defined(ARDUINO_ARCH_ESP8266)
+# include <ESP8266WiFi.h>
+# include <ESP8266mDNS.h>
+#elif defined(ARDUINO_ARCH_ESP32)
+# include <WiFi.h>
+# include <ESPmDNS.h>
+#else
+#endif
+
+/** The network link underneath a NetworkManager.
+ *
+ * NetworkManager does not touch the global WiFi and MDNS objects or own a
+ * socket itself, but goes through this interface. Each NetworkManager can
+ * therefore be given its own link, e.g. to run a few simulated devices with
+ * their own sockets in one process (see NetworkManager for the state they
+ * still share). WiFiInterface is the implementation for the real hardware
+ * and used by default.
+ */
+class NetworkInterface
+{
+public:
+  virtual ~NetworkInterface() { }
+
+  /** Start connecting, must not block until connected */
+  virtual void begin(const char *ssid, const char *pass, bool roaming, const char *hostName) = 0;
+
+  /** Start connecting to a known access point without scanning. Falls back
+   * to begin() if not supported.
+   */
+  virtual void
+  beginDirected(const char *ssid, const char *pass, int32_t /* channel */, const uint8_t * /* bssid */, const char *hostName)
+  {
+    begin(ssid, pass, false, hostName);
+  }
+
+  virtual void end() = 0;
+
+  virtual bool connected() = 0;
+
+  virtual int32_t rssi() = 0;
+
+  /** Channel and BSSID of the established link for beginDirected()
+   * @return false if not supported or not connected
+   */
+  virtual bool linkParameters(int32_t & /* channel */, uint8_t /* bssid */[6]) { return false; }
+
+  /** Log details of the established link (addresses etc.) */
+  virtual void logLinkInfo() { }
+
+  /** Log the networks in range, used to help with setting up the SSID */
+  virtual void logVisibleNetworks() { }
+
+  /** Print the networks in range, e.g. for a CLI command */
+  virtual void printVisibleNetworks(Print & /* print */) { }
+
+  /** Announce the host name and the telnet service */
+  virtual bool startMdns(const char *hostName) = 0;
+
+  virtual void stopMdns() { }
+
+  /** The transport to use for the MQTT connection */
+  virtual Client &mqttTransport() = 0;
+};
+
+/** NetworkInterface for the ESP8266/ESP32 station interface */
+class WiFiInterface
+  : public NetworkInterface
+{
+public:
+  void
+  begin(const char *ssid, const char *pass, bool roaming, const char *hostName) override
+  {
+    // Set WiFi mode to station (as opposed to AP or AP_STA)
+    WiFi.mode(WIFI_STA);
+#if defined(ARDUINO_ARCH_ESP8266)
+    // https://github.com/esp8266/Arduino/issues/2826
+    WiFi.hostname(hostName);
+#endif
+    wifiBegin(ssid, pass, roaming);
+#if defined(ARDUINO_ARCH_ESP32)
+    WiFi.setHostname(hostName);
+#endif
+  }
+
+  void
+  beginDirected(const char *ssid, const char *pass, int32_t channel, const uint8_t *bssid, const char *hostName) override
+  {
+    WiFi.mode(WIFI_STA);
+#if defined(ARDUINO_ARCH_ESP8266)
+    WiFi.hostname(hostName);
+#endif
+    WiFi.begin(ssid, pass, channel, bssid);
+#if defined(ARDUINO_ARCH_ESP32)
+    WiFi.setHostname(hostName);
+#endif
+  }
+
+  void
+  end() override
+  {
+    WiFi.disconnect();
+  }
+
+  bool
+  connected() override
+  {
+    return WiFi.status() == WL_CONNECTED;
+  }
+
+  int32_t
+  rssi() override
+  {
+    return WiFi.RSSI();
+  }
+
+  bool
+  linkParameters(int32_t &channel, uint8_t bssid[6]) override
+  {
+    if (not connected()) {
+      return false;
+    }
+    channel = WiFi.channel();
+    memcpy(bssid, WiFi.BSSID(), 6);
+    return true;
+  }
+
+  void
+  logLinkInfo() override
+  {
+    LOG_INFO("wifi", "connected to %s @ %d dB, BSSID %s",
+             WiFi.SSID(), WiFi.RSSI(), WiFi.BSSIDstr());
+#if defined(ARDUINO_ARCH_ESP8266)
+    LOG_INFO("wifi", "IP %s, host name %s", WiFi.localIP(), WiFi.hostname());
+#elif defined(ARDUINO_ARCH_ESP32)
+    LOG_INFO("wifi", "IP %s, host name %s", WiFi.localIP(), WiFi.getHostname());
+#endif
+  }
+
+  void
+  logVisibleNetworks() override
+  {
+    byte n = WiFi.scanNetworks();
+    for (byte i = 0; i < n; i++) {
+      LOG_INFO("wifi", "visible network %s (%d dB)", WiFi.SSID(i), WiFi.RSSI(i));
+    }
+  }
+
+  void
+  printVisibleNetworks(Print &print) override
+  {
+    byte n = WiFi.scanNetworks();
+    if (n) {
+      print << "visible network SSIDs:\n";
+      for (int i = 0; i < n; i++) {
+        print << "  " << WiFi.SSID(i) << " (" << WiFi.RSSI(i) << " dB)\n";
+      }
+    }
+  }
+
+  bool
+  startMdns(const char *hostName) override
+  {
+    if (not MDNS.begin(hostName)) {
+      return false;
+    }
+    MDNS.addService("telnet", "tcp", 23);
+    return true;
+  }
+
+  void
+  stopMdns() override
+  {
+    MDNS.end();
+  }
+
+  Client &
+  mqttTransport() override
+  {
+    return m_client;
+  }
+
+  void
+  wifiBegin(const char *ssid, const char *pass, bool roaming)
+  {
+    if (roaming) {
+      LOG_INFO("wifi", "roaming for %s:", ssid);
+      byte n = WiFi.scanNetworks();
+      int32_t bestRssi = INT32_MIN;
+      int32_t bestIdx = -1;
+      for (byte i = 0; i < n; i++) {
+        if (strcmp(ssid, WiFi.SSID(i).c_str()) == 0) {
+          auto rssi = WiFi.RSSI(i);
+
+          bool better = rssi > bestRssi;
+
+          LOG_INFO("wifi", " %c %s @ %d dB", better ? '+' : '-', WiFi.BSSIDstr(i), rssi);
+
+          if (better) {
+            bestRssi = rssi;
+            bestIdx = i;
+          }
+        }
+      }
+      if (bestIdx >= 0) {
+        WiFi.begin(ssid,
+                   pass,
+                   0 /* channel */,
+                   WiFi.BSSID(bestIdx));
+        return;
+      }
+      LOG_WARN("wifi", "network not found - falling back to regular operation");
+      // No entry found in scan list, falling back to non-roaming
+    }
+
+    WiFi.begin(ssid, pass);
+  }
+
+private:
+  WiFiClient m_client;
+};
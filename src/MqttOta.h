@@ -0,0 +1,505 @@
+#pragma once
+
+#include <MqttNetwork.h>
+
+#if defined(ARDUINO_ARCH_ESP8266)
+# include <Updater.h>
+#elif defined(ARDUINO_ARCH_ESP32)
+# include <Update.h>
+#endif
+
+/** Destination of a firmware image received by MqttOta.
+ *
+ * Implement this to store images somewhere else than the update partition,
+ * e.g. a fake flash when exercising the chunk pipeline without hardware.
+ */
+class OtaWriter
+{
+public:
+  virtual ~OtaWriter() { }
+
+  /** Prepare for an image of imageSize bytes with the given MD5 digest
+   * (32 hex characters).
+   */
+  virtual bool begin(size_t imageSize, const char *md5) = 0;
+
+  /** Return true if write() accepts arbitrary offsets. Otherwise chunks are
+   * only passed in order.
+   */
+  virtual bool seekable() const
+  {
+    return false;
+  }
+
+  virtual bool write(size_t offset, const uint8_t *data, size_t len) = 0;
+
+  /** Finish the image and verify its digest */
+  virtual bool end() = 0;
+
+  virtual void abort() = 0;
+};
+
+/** Writes the image to the update partition using the Arduino core's
+ * Update object, which also verifies the MD5 digest.
+ */
+class UpdateOtaWriter
+  : public OtaWriter
+{
+public:
+  bool
+  begin(size_t imageSize, const char *md5) override
+  {
+    if (Update.isRunning()) {
+      abort();
+    }
+    if (not Update.begin(imageSize)) {
+      return false;
+    }
+    return Update.setMD5(md5);
+  }
+
+  bool
+  write(size_t offset, const uint8_t *data, size_t len) override
+  {
+    if (offset != Update.progress()) {
+      return false;
+    }
+    return Update.write(const_cast<uint8_t *>(data), len) == len;
+  }
+
+  bool
+  end() override
+  {
+    return Update.end();
+  }
+
+  void
+  abort() override
+  {
+#if defined(ARDUINO_ARCH_ESP32)
+    Update.abort();
+#else
+    /* ends with an error since data is missing, but resets the updater */
+    Update.end();
+#endif
+  }
+};
+
+/** Firmware update over MQTT.
+ *
+ * The image is transferred in numbered chunks and written to flash as they
+ * arrive, so it never has to fit into RAM. Received chunks are tracked in a
+ * bitmap: if the link or the broker drops out in the middle of a transfer,
+ * the sender can resume where it left off instead of starting over.
+ *
+ * Topics (prefix see NetworkManager::topicPrefix()):
+ *
+ *   <prefix>/ota/begin   "<image size> <chunk size> <md5 hex>"
+ *                        Starts a transfer. Sending the same begin message
+ *                        again during a transfer resumes it, a different
+ *                        valid one replaces the transfer.
+ *   <prefix>/ota/chunk   4 byte big endian chunk index followed by the chunk
+ *                        data. All chunks except the last one must have
+ *                        exactly <chunk size> bytes.
+ *   <prefix>/ota/abort   Cancels the transfer.
+ *   <prefix>/ota/status  Published by the device:
+ *                          "receiving <received>/<total> next <index>"
+ *                          "done", "error <reason>", "aborted"
+ *                          "rejected <reason>" (invalid begin message
+ *                          during a transfer, which continues)
+ *                        Senders resume from <index> after an interruption.
+ *
+ * With the default OtaWriter chunks must arrive in order, out of order
+ * chunks are dropped and reported via the status topic. The chunk size plus
+ * topic must fit into the MQTT client's buffer, begin() enlarges it if
+ * necessary.
+ *
+ * Status messages are published from run(), never from within the MQTT
+ * message handler (see NetworkManager::subscribe()).
+ *
+ * After a verified image has been written, the device reboots (see
+ * setRebootOnSuccess()). A reboot during the transfer discards the partial
+ * image.
+ */
+template <size_t _MaxChunks = 2048>
+class MqttOta
+{
+public:
+  /* Publish a progress status at most every ... */
+  static const unsigned long StatusIntervalMs = 1000;
+  /* Report a stalled transfer after ... */
+  static const unsigned long StallTimeoutMs = 30 * 1000UL;
+  /* Delay between a successful update and the reboot */
+  static const unsigned long RebootDelayMs = 2000;
+
+  typedef enum
+  {
+    StateIdle,
+    StateReceiving,
+    StateDone,
+    StateError,
+  } State;
+
+  MqttOta(NetworkManager &networkManager,
+          OtaWriter &writer,
+          size_t maxChunkSize = 1024)
+    : m_networkManager(networkManager)
+    , m_writer(writer)
+    , m_maxChunkSize(maxChunkSize)
+    , m_state(StateIdle)
+    , m_imageSize(0)
+    , m_chunkSize(0)
+    , m_numChunks(0)
+    , m_numReceived(0)
+    , m_nextChunk(0)
+    , m_lastChunkMs(0)
+    , m_lastStatusMs(0)
+    , m_statusPending(false)
+    , m_statusReady(false)
+    , m_rebootOnSuccess(true)
+    , m_rebootPending(false)
+    , m_doneMs(0)
+    , m_generation(0)
+  {
+    m_md5[0] = 0;
+    m_beginTopic[0] = 0;
+    m_chunkTopic[0] = 0;
+    m_abortTopic[0] = 0;
+    m_statusTopic[0] = 0;
+    m_status[0] = 0;
+    memset(m_bitmap, 0, sizeof(m_bitmap));
+  }
+
+  /** Build the OTA topics and subscribe. run() rebuilds them and subscribes
+   * again when the topic prefix changes, see
+   * NetworkManager::topicPrefixChanged().
+   */
+  void
+  begin()
+  {
+    m_networkManager.unsubscribe(&MqttOta::onMessage, this);
+
+    m_generation = m_networkManager.topicPrefixGeneration();
+    const char *prefix = m_networkManager.topicPrefix();
+    snprintf(m_beginTopic, sizeof(m_beginTopic), "%s/ota/begin", prefix);
+    snprintf(m_chunkTopic, sizeof(m_chunkTopic), "%s/ota/chunk", prefix);
+    snprintf(m_abortTopic, sizeof(m_abortTopic), "%s/ota/abort", prefix);
+    snprintf(m_statusTopic, sizeof(m_statusTopic), "%s/ota/status", prefix);
+
+    /* PUBLISH packet of a full chunk: fixed header byte, up to 4 remaining
+     * length bytes, topic length, topic, chunk index and data
+     */
+    PubSubClient &client = m_networkManager.getMqttClient();
+    size_t needed = 1 + 4 + 2 + strlen(m_chunkTopic) + 4 + m_maxChunkSize;
+    if (client.getBufferSize() < needed) {
+      client.setBufferSize(needed);
+    }
+
+    /* not "ota/+", which would deliver our own status messages back to us */
+    m_networkManager.subscribe(m_beginTopic, &MqttOta::onMessage, this);
+    m_networkManager.subscribe(m_chunkTopic, &MqttOta::onMessage, this);
+    m_networkManager.subscribe(m_abortTopic, &MqttOta::onMessage, this);
+  }
+
+  void
+  run()
+  {
+    unsigned long now = millis();
+
+    if (m_rebootPending and now - m_doneMs > RebootDelayMs) {
+      ESP.restart();
+    }
+
+    if (m_beginTopic[0] and m_generation != m_networkManager.topicPrefixGeneration()) {
+      begin();
+    }
+
+    if (m_state == StateReceiving and now - m_lastChunkMs > StallTimeoutMs) {
+      /* keep everything so the sender can resume */
+      m_lastChunkMs = now;
+      m_statusPending = true;
+    }
+
+    if (m_statusReady) {
+      m_statusReady = false;
+      m_lastStatusMs = now;
+      m_networkManager.publish(m_statusTopic, m_status, false, PriorityControl);
+    } else if (m_statusPending and now - m_lastStatusMs >= StatusIntervalMs) {
+      publishProgress();
+    }
+  }
+
+  void
+  setRebootOnSuccess(bool reboot)
+  {
+    m_rebootOnSuccess = reboot;
+  }
+
+  State
+  getState() const
+  {
+    return m_state;
+  }
+
+  size_t
+  numChunks() const
+  {
+    return m_numChunks;
+  }
+
+  size_t
+  numReceived() const
+  {
+    return m_numReceived;
+  }
+
+private:
+  static void
+  onMessage(void *context, const char *topic, const uint8_t *payload, unsigned int length)
+  {
+    MqttOta *self = static_cast<MqttOta *>(context);
+
+    if (strcmp(topic, self->m_chunkTopic) == 0) {
+      self->receiveChunk(payload, length);
+    } else if (strcmp(topic, self->m_beginTopic) == 0) {
+      self->receiveBegin(payload, length);
+    } else if (strcmp(topic, self->m_abortTopic) == 0) {
+      self->abort();
+    }
+  }
+
+  void
+  receiveBegin(const uint8_t *payload, unsigned int length)
+  {
+    char buf[80];
+    if (length >= sizeof(buf)) {
+      rejectBegin("invalid begin");
+      return;
+    }
+    memcpy(buf, payload, length);
+    buf[length] = 0;
+
+    unsigned long imageSize = 0, chunkSize = 0;
+    char md5[33] = {0};
+    if (sscanf(buf, "%lu %lu %32s", &imageSize, &chunkSize, md5) != 3 or strlen(md5) != 32) {
+      rejectBegin("invalid begin");
+      return;
+    }
+
+    if (m_state == StateReceiving and
+        imageSize == m_imageSize and
+        chunkSize == m_chunkSize and
+        strcmp(md5, m_md5) == 0) {
+      /* resume */
+      requestProgress();
+      return;
+    }
+
+    if (chunkSize == 0 or chunkSize > m_maxChunkSize) {
+      rejectBegin("invalid chunk size");
+      return;
+    }
+    size_t numChunks = (imageSize + chunkSize - 1) / chunkSize;
+    if (numChunks == 0 or numChunks > _MaxChunks) {
+      rejectBegin("invalid image size");
+      return;
+    }
+
+    if (m_state == StateReceiving) {
+      m_writer.abort();
+      m_state = StateIdle;
+    }
+    if (not m_writer.begin(imageSize, md5)) {
+      publishError("can not begin update");
+      return;
+    }
+
+    m_state = StateReceiving;
+    m_imageSize = imageSize;
+    m_chunkSize = chunkSize;
+    m_numChunks = numChunks;
+    m_numReceived = 0;
+    m_nextChunk = 0;
+    m_lastChunkMs = millis();
+    memcpy(m_md5, md5, sizeof(m_md5));
+    memset(m_bitmap, 0, sizeof(m_bitmap));
+
+    requestProgress();
+  }
+
+  void
+  receiveChunk(const uint8_t *payload, unsigned int length)
+  {
+    if (m_state != StateReceiving or length < 4) {
+      return;
+    }
+    uint32_t idx = (uint32_t(payload[0]) << 24) |
+                   (uint32_t(payload[1]) << 16) |
+                   (uint32_t(payload[2]) <<  8) |
+                    uint32_t(payload[3]);
+    payload += 4;
+    length -= 4;
+
+    if (idx >= m_numChunks) {
+      return;
+    }
+
+    m_lastChunkMs = millis();
+
+    if (haveChunk(idx)) {
+      /* duplicate after resume */
+      return;
+    }
+
+    size_t offset = idx * m_chunkSize;
+    size_t expected = idx == m_numChunks - 1 ? m_imageSize - offset : m_chunkSize;
+    if (length != expected) {
+      m_statusPending = true;
+      return;
+    }
+    if (not m_writer.seekable() and idx != m_nextChunk) {
+      /* out of order - tell the sender where to continue */
+      m_statusPending = true;
+      return;
+    }
+
+    if (not m_writer.write(offset, payload, length)) {
+      publishError("write failed");
+      return;
+    }
+
+    m_bitmap[idx / 8] |= 1 << (idx % 8);
+    m_numReceived++;
+    while (m_nextChunk < m_numChunks and haveChunk(m_nextChunk)) {
+      m_nextChunk++;
+    }
+    m_statusPending = true;
+
+    if (m_numReceived == m_numChunks) {
+      finish();
+    }
+  }
+
+  void
+  finish()
+  {
+    if (not m_writer.end()) {
+      m_state = StateError;
+      publishError("verification failed");
+      return;
+    }
+    m_state = StateDone;
+    m_statusPending = false;
+    setStatus("done");
+    /* reboot from run() to give the status message some time to get out */
+    m_rebootPending = m_rebootOnSuccess;
+    m_doneMs = millis();
+  }
+
+  void
+  abort()
+  {
+    if (m_state == StateReceiving) {
+      m_writer.abort();
+    }
+    m_state = StateIdle;
+    m_statusPending = false;
+    setStatus("aborted");
+  }
+
+  bool
+  haveChunk(size_t idx) const
+  {
+    return m_bitmap[idx / 8] & (1 << (idx % 8));
+  }
+
+  /** Publish the progress with the next run() */
+  void
+  requestProgress()
+  {
+    m_statusPending = true;
+    m_lastStatusMs = millis() - StatusIntervalMs;
+  }
+
+  void
+  publishProgress()
+  {
+    char buf[48];
+    snprintf(buf, sizeof(buf), "receiving %u/%u next %u",
+             static_cast<unsigned>(m_numReceived),
+             static_cast<unsigned>(m_numChunks),
+             static_cast<unsigned>(m_nextChunk));
+    m_lastStatusMs = millis();
+    m_networkManager.publish(m_statusTopic, buf, false, PriorityControl);
+    m_statusPending = false;
+  }
+
+  /** Refuse an invalid begin message. A running transfer is left alone,
+   * otherwise this is an error.
+   */
+  void
+  rejectBegin(const char *reason)
+  {
+    if (m_state != StateReceiving) {
+      publishError(reason);
+      return;
+    }
+    snprintf(m_status, sizeof(m_status), "rejected %s", reason);
+    m_statusReady = true;
+  }
+
+  /** Cancels a running transfer and reports the error */
+  void
+  publishError(const char *reason)
+  {
+    if (m_state == StateReceiving) {
+      m_writer.abort();
+    }
+    m_state = StateError;
+    m_statusPending = false;
+    snprintf(m_status, sizeof(m_status), "error %s", reason);
+    m_statusReady = true;
+  }
+
+  /** Queue a final status, published by run() */
+  void
+  setStatus(const char *status)
+  {
+    strncpy(m_status, status, sizeof(m_status) - 1);
+    m_status[sizeof(m_status) - 1] = 0;
+    m_statusReady = true;
+  }
+
+  NetworkManager &m_networkManager;
+  OtaWriter &m_writer;
+  size_t m_maxChunkSize;
+
+  State m_state;
+  size_t m_imageSize;
+  size_t m_chunkSize;
+  size_t m_numChunks;
+  size_t m_numReceived;
+  /* first chunk not yet received */
+  size_t m_nextChunk;
+  char m_md5[33];
+  uint8_t m_bitmap[(_MaxChunks + 7) / 8];
+
+  unsigned long m_lastChunkMs;
+  unsigned long m_lastStatusMs;
+  /* progress report due */
+  bool m_statusPending;
+  /* final status in m_status to be published */
+  bool m_statusReady;
+  char m_status[48];
+
+  bool m_rebootOnSuccess;
+  bool m_rebootPending;
+  unsigned long m_doneMs;
+
+  /* topic prefix generation the topics were built for */
+  uint32_t m_generation;
+  char m_beginTopic[MaxMqttClientNameLen + 1 + 10];
+  char m_chunkTopic[MaxMqttClientNameLen + 1 + 10];
+  char m_abortTopic[MaxMqttClientNameLen + 1 + 10];
+  char m_statusTopic[MaxMqttClientNameLen + 1 + 11];
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <MqttCbor.h>
+
+/** Encoding of a topic's payload.
+ *
+ * Text is human readable (plain value or JSON object), CBOR is typically
+ * 2 to 4 times smaller and considerably cheaper to produce and parse.
+ */
+typedef enum
+{
+  ContentFormatText,
+  ContentFormatCbor,
+} ContentFormat;
+
+/** Encodes payloads either as text or as CBOR with the same API, so the
+ * content format can be chosen per topic without touching the code producing
+ * the values.
+ *
+ * Single values:
+ *
+ *   PayloadWriter w(format, buf, sizeof(buf));
+ *   w.value(temperature);
+ *
+ *     text:  21.50
+ *     CBOR:  fa 41 ac 00 00
+ *
+ * Objects:
+ *
+ *   w.beginObject().field("t", temperature).field("h", humidity).endObject();
+ *
+ *     text:  {"t":21.50,"h":40}
+ *     CBOR:  bf 61 74 fa 41 ac 00 00 61 68 18 28 ff
+ *
+ * Like PayloadSink the writer never allocates. Text formatting uses a small
+ * stack buffer per value.
+ */
+class PayloadWriter
+{
+public:
+  /** Counting writer, see PayloadSink */
+  PayloadWriter(ContentFormat format)
+    : m_format(format)
+    , m_first(true)
+  { }
+
+  PayloadWriter(ContentFormat format, uint8_t *buffer, size_t capacity)
+    : m_format(format)
+    , m_cbor(buffer, capacity)
+    , m_first(true)
+  { }
+
+  PayloadWriter(ContentFormat format, Print &print)
+    : m_format(format)
+    , m_cbor(print)
+    , m_first(true)
+  { }
+
+  PayloadWriter &
+  value(float v, uint8_t decimals = 2)
+  {
+    if (m_format == ContentFormatCbor) {
+      m_cbor.writeFloat(v);
+    } else {
+      putFormatted("%.*f", decimals, v);
+    }
+    return *this;
+  }
+
+  PayloadWriter &
+  value(double v, uint8_t decimals = 2)
+  {
+    return value(static_cast<float>(v), decimals);
+  }
+
+  PayloadWriter &
+  value(long v)
+  {
+    if (m_format == ContentFormatCbor) {
+      m_cbor.writeInt(static_cast<int32_t>(v));
+    } else {
+      putFormatted("%ld", v);
+    }
+    return *this;
+  }
+
+  PayloadWriter &
+  value(unsigned long v)
+  {
+    if (m_format == ContentFormatCbor) {
+      m_cbor.writeUint(static_cast<uint32_t>(v));
+    } else {
+      putFormatted("%lu", v);
+    }
+    return *this;
+  }
+
+  PayloadWriter &
+  value(int v)
+  {
+    return value(static_cast<long>(v));
+  }
+
+  PayloadWriter &
+  value(unsigned int v)
+  {
+    return value(static_cast<unsigned long>(v));
+  }
+
+  PayloadWriter &
+  value(bool v)
+  {
+    if (m_format == ContentFormatCbor) {
+      m_cbor.writeBool(v);
+    } else {
+      putText(v ? "true" : "false");
+    }
+    return *this;
+  }
+
+  /** Strings are written verbatim in text mode when standing alone and
+   * quoted and escaped as JSON strings (RFC 8259) inside objects.
+   */
+  PayloadWriter &
+  value(const char *v)
+  {
+    if (m_format == ContentFormatCbor) {
+      m_cbor.writeString(v);
+    } else if (m_first) {
+      putText(v);
+    } else {
+      putText("\"");
+      putEscaped(v);
+      putText("\"");
+    }
+    return *this;
+  }
+
+  PayloadWriter &
+  beginObject()
+  {
+    if (m_format == ContentFormatCbor) {
+      m_cbor.beginIndefiniteMap();
+    } else {
+      putText("{");
+    }
+    m_first = true;
+    return *this;
+  }
+
+  template <typename T>
+  PayloadWriter &
+  field(const char *key, T v)
+  {
+    if (m_format == ContentFormatCbor) {
+      m_cbor.writeString(key);
+    } else {
+      putText(m_first ? "\"" : ",\"");
+      putText(key);
+      putText("\":");
+    }
+    m_first = false;
+    return value(v);
+  }
+
+  PayloadWriter &
+  endObject()
+  {
+    if (m_format == ContentFormatCbor) {
+      m_cbor.endIndefinite();
+    } else {
+      putText("}");
+    }
+    return *this;
+  }
+
+  ContentFormat
+  format() const
+  {
+    return m_format;
+  }
+
+  const uint8_t *
+  data() const
+  {
+    return m_cbor.data();
+  }
+
+  size_t
+  size() const
+  {
+    return m_cbor.size();
+  }
+
+  bool
+  ok() const
+  {
+    return m_cbor.ok();
+  }
+
+  void
+  reset()
+  {
+    m_cbor.reset();
+    m_first = true;
+  }
+
+private:
+  void
+  putText(const char *str)
+  {
+    putText(str, strlen(str));
+  }
+
+  void
+  putText(const char *str, size_t len)
+  {
+    m_cbor.sink().put(reinterpret_cast<const uint8_t *>(str), len);
+  }
+
+  /** Write str as the contents of a JSON string: quote, backslash and
+   * control characters are escaped, everything else is copied in runs
+   */
+  void
+  putEscaped(const char *str)
+  {
+    static const char Hex[] = "0123456789abcdef";
+    const char *run = str;
+    for (; *str; str++) {
+      uint8_t c = *str;
+      if (c >= 0x20 and c != '"' and c != '\\') {
+        continue;
+      }
+      putText(run, str - run);
+      run = str + 1;
+      char esc[6] = { '\\', static_cast<char>(c), 0, 0, 0, 0 };
+      size_t len = 2;
+      switch (c) {
+        case '"':
+        case '\\':
+          break;
+        case '\b': esc[1] = 'b'; break;
+        case '\f': esc[1] = 'f'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\t': esc[1] = 't'; break;
+        default:
+          esc[1] = 'u';
+          esc[2] = '0';
+          esc[3] = '0';
+          esc[4] = Hex[c >> 4];
+          esc[5] = Hex[c & 0xf];
+          len = 6;
+          break;
+      }
+      putText(esc, len);
+    }
+    putText(run, str - run);
+  }
+
+  void
+  putFormatted(const char *fmt, ...)
+  {
+    char buf[24];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (n < 0 or static_cast<size_t>(n) >= sizeof(buf)) {
+      /* a truncated number is a wrong number */
+      m_cbor.sink().setOverflow();
+      return;
+    }
+    putText(buf, n);
+  }
+
+  ContentFormat m_format;
+  CborWriter m_cbor;
+  bool m_first;
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <Arduino.h>
+
+/** FNV-1a hash over length bytes */
+inline uint32_t
+fnv1aHash(const uint8_t *data, size_t length)
+{
+  uint32_t h = 2166136261UL;
+  for (size_t i = 0; i < length; i++) {
+    h ^= data[i];
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+/** FNV-1a hash of a zero terminated string */
+inline uint32_t
+topicHash(const char *topic)
+{
+  return fnv1aHash(reinterpret_cast<const uint8_t *>(topic), strlen(topic));
+}
+
+/** How a PublishFilter compares numeric values, see
+ * NetworkManager::publishValue()
+ */
+typedef enum
+{
+  /* only identical payloads are suppressed */
+  DeadbandNone,
+  /* values within +/- deadband of the last sent value are suppressed */
+  DeadbandAbsolute,
+  /* values within +/- deadband * |last sent value| are suppressed */
+  DeadbandRelative,
+} DeadbandMode;
+
+/** Change detection for a single topic.
+ *
+ * A message is suppressed if its payload is identical to the last one sent
+ * (compared by hash) or, for numeric values, if it lies within the
+ * deadband. Once the last message sent is older than the maximum silence,
+ * the next message is sent in any case, so consumers still see the topic
+ * alive.
+ */
+class PublishFilter
+{
+public:
+  static const unsigned long DefaultMaxSilenceMs = 5 * 60 * 1000UL;
+
+  PublishFilter()
+  {
+    configure(DeadbandNone, 0, DefaultMaxSilenceMs);
+  }
+
+  /** @param maxSilenceMs 0 suppresses unchanged messages indefinitely */
+  void
+  configure(DeadbandMode mode, float deadband, unsigned long maxSilenceMs)
+  {
+    m_mode = mode;
+    m_deadband = deadband < 0 ? -deadband : deadband;
+    m_maxSilenceMs = maxSilenceMs;
+    m_lastValue = 0;
+    resetCounters();
+    invalidate();
+  }
+
+  void
+  resetCounters()
+  {
+    m_numSent = 0;
+    m_numSuppressed = 0;
+  }
+
+  /** Forget the last message, the next one is sent */
+  void
+  invalidate()
+  {
+    m_valid = false;
+  }
+
+  bool
+  repeats(uint32_t payloadHash, unsigned long now) const
+  {
+    return quiet(now) and payloadHash == m_lastHash;
+  }
+
+  bool
+  withinDeadband(float value, unsigned long now) const
+  {
+    if (not quiet(now) or m_mode == DeadbandNone) {
+      return false;
+    }
+    float diff = value - m_lastValue;
+    if (diff < 0) {
+      diff = -diff;
+    }
+    float band = m_mode == DeadbandAbsolute
+               ? m_deadband
+               : m_deadband * (m_lastValue < 0 ? -m_lastValue : m_lastValue);
+    return diff <= band;
+  }
+
+  void
+  sent(uint32_t payloadHash, unsigned long now)
+  {
+    m_valid = true;
+    m_lastHash = payloadHash;
+    m_lastSentMs = now;
+    m_numSent++;
+  }
+
+  void
+  sentValue(float value)
+  {
+    m_lastValue = value;
+  }
+
+  void
+  suppressed()
+  {
+    m_numSuppressed++;
+  }
+
+  unsigned long
+  numSent() const
+  {
+    return m_numSent;
+  }
+
+  unsigned long
+  numSuppressed() const
+  {
+    return m_numSuppressed;
+  }
+
+private:
+  /** Check if the last message is recent enough to suppress the next */
+  bool
+  quiet(unsigned long now) const
+  {
+    return m_valid and (not m_maxSilenceMs or now - m_lastSentMs < m_maxSilenceMs);
+  }
+
+  DeadbandMode m_mode;
+  float m_deadband;
+  unsigned long m_maxSilenceMs;
+
+  bool m_valid;
+  uint32_t m_lastHash;
+  float m_lastValue;
+  unsigned long m_lastSentMs;
+
+  unsigned long m_numSent;
+  unsigned long m_numSuppressed;
+};
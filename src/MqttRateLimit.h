@@ -0,0 +1,216 @@
+#pragma once
+
+#include <Arduino.h>
+
+/** Priority of a published message, see PublishRateLimiter */
+typedef enum
+{
+  /* Link probes, CLI responses, OTA status - never shed */
+  PriorityControl,
+  /* Alarms and events - shed only if the link budget is nearly exhausted */
+  PriorityAlarm,
+  /* Periodic measurements, logs - shed first */
+  PriorityTelemetry,
+
+  NumPublishPriorities,
+} PublishPriority;
+
+/** Token bucket with integer arithmetic.
+ *
+ * Tokens are kept in thousandths so millisecond refills at low rates do not
+ * get lost. A rate of zero disables the bucket (everything passes).
+ */
+class TokenBucket
+{
+public:
+  TokenBucket(uint16_t ratePerS = 0, uint16_t burst = 0)
+  {
+    configure(ratePerS, burst);
+  }
+
+  void
+  configure(uint16_t ratePerS, uint16_t burst)
+  {
+    m_ratePerS = ratePerS;
+    m_capacity = static_cast<uint32_t>(burst ? burst : 1) * 1000;
+    m_tokens = m_capacity;
+    m_lastRefillMs = millis();
+  }
+
+  bool
+  enabled() const
+  {
+    return m_ratePerS != 0;
+  }
+
+  void
+  refill(unsigned long now)
+  {
+    unsigned long elapsed = now - m_lastRefillMs;
+    m_lastRefillMs = now;
+    uint64_t add = static_cast<uint64_t>(elapsed) * m_ratePerS;
+    m_tokens = m_capacity - m_tokens < add ? m_capacity : m_tokens + add;
+  }
+
+  /** Check if at least cost tokens plus reserve are available */
+  bool
+  available(uint16_t cost, uint32_t reserveMilli = 0) const
+  {
+    return not enabled() or m_tokens >= cost * 1000UL + reserveMilli;
+  }
+
+  /** Take cost tokens, as many as there are if less */
+  void
+  take(uint16_t cost)
+  {
+    uint32_t c = cost * 1000UL;
+    m_tokens = m_tokens > c ? m_tokens - c : 0;
+  }
+
+  uint32_t
+  capacityMilli() const
+  {
+    return m_capacity;
+  }
+
+  /** Current fill level in percent */
+  uint8_t
+  level() const
+  {
+    return enabled() ? (static_cast<uint64_t>(m_tokens) * 100) / m_capacity : 100;
+  }
+
+private:
+  uint16_t m_ratePerS;
+  uint32_t m_capacity;
+  uint32_t m_tokens;
+  unsigned long m_lastRefillMs;
+};
+
+/** Rate limit and priority layer in front of the MQTT publish path.
+ *
+ * Every message has to pass two buckets: the bucket of its priority class
+ * and a shared link bucket. The link bucket keeps a reserve per priority:
+ * telemetry is only sent while the bucket is more than half full, alarms
+ * while more than a quarter is left, so under pressure telemetry is shed
+ * first and the remaining budget goes to alarms and control traffic.
+ * Control messages are never dropped, they just drain the buckets.
+ *
+ * The cost of a message is one token plus one per complete 512 bytes of
+ * payload. Dropped messages are counted per priority (see "m.stats") and
+ * publish() returns false for them.
+ *
+ * All limits are off by default, so sketches publishing in bursts are not
+ * affected unless they opt in, e.g. with
+ *
+ *   networkManager.getRateLimiter().setLinkLimit(25, 50);
+ */
+class PublishRateLimiter
+{
+public:
+  PublishRateLimiter()
+    : m_bypass(false)
+  {
+    reset();
+  }
+
+  /** Limit the overall message rate. A rate of 0 (the default) disables
+   * limiting, the priority reserves only apply while enabled.
+   */
+  void
+  setLinkLimit(uint16_t ratePerS, uint16_t burst)
+  {
+    m_link.configure(ratePerS, burst);
+  }
+
+  /** Limit the message rate of a priority class. A rate of 0 (the default)
+   * disables the class limit.
+   */
+  void
+  setClassLimit(PublishPriority priority, uint16_t ratePerS, uint16_t burst)
+  {
+    m_classes[priority].configure(ratePerS, burst);
+  }
+
+  /** Admit every message without touching the buckets, e.g. while
+   * benchmarking. The configured limits are kept.
+   */
+  void
+  setBypass(bool bypass)
+  {
+    m_bypass = bypass;
+  }
+
+  bool
+  bypass() const
+  {
+    return m_bypass;
+  }
+
+  /** Decide if a message may be published and account for it */
+  bool
+  admit(PublishPriority priority, size_t length)
+  {
+    if (m_bypass) {
+      m_numAdmitted[priority]++;
+      return true;
+    }
+
+    unsigned long now = millis();
+    uint16_t cost = 1 + length / 512;
+
+    TokenBucket &cls = m_classes[priority];
+    cls.refill(now);
+    m_link.refill(now);
+
+    if (priority != PriorityControl) {
+      uint32_t reserve = priority == PriorityAlarm
+                       ? m_link.capacityMilli() / 4
+                       : m_link.capacityMilli() / 2;
+      if (not cls.available(cost) or not m_link.available(cost, reserve)) {
+        m_numDropped[priority]++;
+        return false;
+      }
+    }
+
+    cls.take(cost);
+    m_link.take(cost);
+    m_numAdmitted[priority]++;
+    return true;
+  }
+
+  unsigned long
+  numAdmitted(PublishPriority priority) const
+  {
+    return m_numAdmitted[priority];
+  }
+
+  unsigned long
+  numDropped(PublishPriority priority) const
+  {
+    return m_numDropped[priority];
+  }
+
+  /** Link bucket fill level in percent */
+  uint8_t
+  linkLevel() const
+  {
+    return m_link.level();
+  }
+
+  void
+  reset()
+  {
+    for (uint8_t i = 0; i < NumPublishPriorities; i++) {
+      m_numAdmitted[i] = 0;
+      m_numDropped[i] = 0;
+    }
+  }
+
+private:
+  TokenBucket m_link;
+  TokenBucket m_classes[NumPublishPriorities];
+  unsigned long m_numAdmitted[NumPublishPriorities];
+  unsigned long m_numDropped[NumPublishPriorities];
+  bool m_bypass;
+};
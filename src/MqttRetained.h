@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Arduino.h>
+
+/** A record in memory surviving deep sleep and software resets but not a
+ * power cycle: the RTC user memory on the ESP8266, RTC memory which is not
+ * initialized at boot on the ESP32. The contents are undefined after power
+ * up, so T should carry a magic number to validate it.
+ *
+ * @param _RtcBlock ESP8266: offset in the RTC user memory in 4 byte blocks,
+ * records must not overlap. Ignored elsewhere.
+ */
+template <typename T, uint32_t _RtcBlock>
+class RetainedMemory
+{
+public:
+  static bool
+  read(T &record)
+  {
+#if defined(ARDUINO_ARCH_ESP8266)
+    return ESP.rtcUserMemoryRead(_RtcBlock, reinterpret_cast<uint32_t *>(&record), sizeof(T));
+#else
+    record = storage();
+    return true;
+#endif
+  }
+
+  static bool
+  write(const T &record)
+  {
+#if defined(ARDUINO_ARCH_ESP8266)
+    return ESP.rtcUserMemoryWrite(_RtcBlock,
+                                  reinterpret_cast<uint32_t *>(const_cast<T *>(&record)),
+                                  sizeof(T));
+#else
+    storage() = record;
+    return true;
+#endif
+  }
+
+private:
+  static_assert(sizeof(T) % 4 == 0, "RTC memory is accessed in 4 byte blocks");
+  static_assert(_RtcBlock * 4 + sizeof(T) <= 512, "RTC user memory is 512 bytes");
+
+#ifndef ARDUINO_ARCH_ESP8266
+  static T &
+  storage()
+  {
+# if defined(ARDUINO_ARCH_ESP32)
+    static RTC_NOINIT_ATTR T record;
+# else
+    static T record;
+# endif
+    return record;
+  }
+#endif
+};
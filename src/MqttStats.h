@@ -0,0 +1,156 @@
+#pragma once
+
+#include <Arduino.h>
+
+/** Latency histogram with power of two buckets.
+ *
+ * Bucket i counts samples in [2^(i-1), 2^i) microseconds, bucket 0 the
+ * samples below 1 us, the last bucket everything above. Percentiles are
+ * reported as the upper bound of the bucket they fall into, which is
+ * accurate to a factor of two at a fixed cost of a few bytes.
+ *
+ * decay() halves all counts. Calling it periodically turns the histogram
+ * into a rolling one in which old samples fade out.
+ */
+class LatencyHistogram
+{
+public:
+  static const uint8_t NumBuckets = 24;
+
+  LatencyHistogram()
+  {
+    reset();
+  }
+
+  void
+  record(unsigned long us)
+  {
+    uint8_t i = 0;
+    while (us and i < NumBuckets - 1) {
+      us >>= 1;
+      i++;
+    }
+    m_buckets[i]++;
+    m_count++;
+  }
+
+  /** Upper bound of the p-th percentile in microseconds, 0 if empty
+   * @param p Percentile in [0, 100]
+   */
+  unsigned long
+  percentileUs(uint8_t p) const
+  {
+    if (m_count == 0) {
+      return 0;
+    }
+    uint32_t rank = (static_cast<uint64_t>(m_count) * p + 99) / 100;
+    if (rank == 0) {
+      rank = 1;
+    }
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < NumBuckets; i++) {
+      sum += m_buckets[i];
+      if (sum >= rank) {
+        return 1UL << i;
+      }
+    }
+    return 1UL << (NumBuckets - 1);
+  }
+
+  uint32_t
+  count() const
+  {
+    return m_count;
+  }
+
+  void
+  decay()
+  {
+    m_count = 0;
+    for (uint8_t i = 0; i < NumBuckets; i++) {
+      m_buckets[i] /= 2;
+      m_count += m_buckets[i];
+    }
+  }
+
+  void
+  reset()
+  {
+    memset(m_buckets, 0, sizeof(m_buckets));
+    m_count = 0;
+  }
+
+private:
+  uint32_t m_buckets[NumBuckets];
+  uint32_t m_count;
+};
+
+/** Timestamps of a single published message, see
+ * NetworkManager::setPublishTraceCallback()
+ */
+struct PublishTrace
+{
+  const char *topic;
+  size_t length;
+  /* micros() when publish() was called */
+  unsigned long enqueuedUs;
+  /* micros() when the message had been written to the socket */
+  unsigned long writtenUs;
+  bool ok;
+};
+
+/** Message and byte counters plus publish latency of a NetworkManager */
+struct MqttStats
+{
+  MqttStats()
+  {
+    reset();
+  }
+
+  void
+  reset()
+  {
+    numPublished = 0;
+    numPublishFailed = 0;
+    numSuppressed = 0;
+    bytesPublished = 0;
+    numReceived = 0;
+    bytesReceived = 0;
+    maxPublishUs = 0;
+    publishLatency.reset();
+  }
+
+  void
+  recordPublish(const PublishTrace &trace)
+  {
+    if (not trace.ok) {
+      numPublishFailed++;
+      return;
+    }
+    unsigned long us = trace.writtenUs - trace.enqueuedUs;
+    numPublished++;
+    bytesPublished += trace.length;
+    publishLatency.record(us);
+    if (us > maxPublishUs) {
+      maxPublishUs = us;
+    }
+  }
+
+  void
+  recordReceive(size_t length)
+  {
+    numReceived++;
+    bytesReceived += length;
+  }
+
+  unsigned long numPublished;
+  unsigned long numPublishFailed;
+  /* unchanged messages not sent, see NetworkManager::setPublishFilter() */
+  unsigned long numSuppressed;
+  unsigned long bytesPublished;
+  unsigned long numReceived;
+  unsigned long bytesReceived;
+  unsigned long maxPublishUs;
+  /* time from publish() to the message being written to the socket */
+  LatencyHistogram publishLatency;
+};
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <MqttNetwork.h>
+
+/** Registry of this device's topics.
+ *
+ * Topics are declared once by their suffix, the registry builds the full
+ * "<prefix>/<suffix>" strings in a fixed arena and hands out small handles
+ * to publish with. No string formatting takes place in the publish path, the
+ * topics are rebuilt only when the topic prefix changes (see
+ * NetworkManager::topicPrefixChanged()):
+ *
+ *   MqttTopics<> topics(networkManager);
+ *   const auto temp = topics.add("sensor/temp");
+ *   const auto env  = topics.add("sensor/env", ContentFormatCbor);
+ *
+ *   topics.publish(temp, "21.5");
+ *   topics.publishStreamed(env, [&](PayloadWriter &w) { ... });
+ *
+ * Each topic can carry a content format, which is used by the publish
+ * variants encoding the payload.
+ */
+template <size_t _MaxTopics = 16,
+          size_t _ArenaSize = 512>
+class MqttTopics
+{
+public:
+  typedef uint8_t Handle;
+  static const Handle InvalidHandle = 0xff;
+
+  MqttTopics(NetworkManager &networkManager)
+    : m_networkManager(networkManager)
+    , m_numTopics(0)
+    , m_used(0)
+    , m_generation(0)
+    , m_built(false)
+  {
+    static_assert(_MaxTopics < InvalidHandle, "too many topics for handle type");
+    static_assert(_ArenaSize < NoOffset, "topic arena too large for offset type");
+  }
+
+  /** Declare a topic.
+   * @param suffix Topic below the device prefix, e.g. "sensor/temp". The
+   * string is not copied and must remain valid.
+   * @return The topic's handle or InvalidHandle if the registry is full
+   */
+  Handle
+  add(const char *suffix, ContentFormat format = ContentFormatText)
+  {
+    if (m_numTopics >= _MaxTopics) {
+      LOG_ERROR("mqtt", "topic registry full, can not add %s", suffix);
+      return InvalidHandle;
+    }
+    Topic &t = m_topics[m_numTopics];
+    t.suffix = suffix;
+    t.offset = NoOffset;
+    t.format = format;
+    m_built = false;
+    return m_numTopics++;
+  }
+
+  /** The full topic string, nullptr for invalid handles or if the arena
+   * is too small
+   */
+  const char *
+  topic(Handle handle)
+  {
+    if (handle >= m_numTopics) {
+      return nullptr;
+    }
+    update();
+    uint16_t offset = m_topics[handle].offset;
+    return offset == NoOffset ? nullptr : m_arena + offset;
+  }
+
+  ContentFormat
+  format(Handle handle) const
+  {
+    return handle < m_numTopics ? m_topics[handle].format : ContentFormatText;
+  }
+
+  bool
+  publish(Handle handle,
+          const uint8_t *payload,
+          unsigned int length,
+          bool retained = false,
+          PublishPriority priority = PriorityTelemetry)
+  {
+    const char *t = topic(handle);
+    return t and m_networkManager.publish(t, payload, length, retained, priority);
+  }
+
+  bool
+  publish(Handle handle,
+          const char *payload,
+          bool retained = false,
+          PublishPriority priority = PriorityTelemetry)
+  {
+    const char *t = topic(handle);
+    return t and m_networkManager.publish(t, payload, retained, priority);
+  }
+
+  bool
+  publish(Handle handle,
+          const PayloadWriter &payload,
+          bool retained = false,
+          PublishPriority priority = PriorityTelemetry)
+  {
+    const char *t = topic(handle);
+    return t and m_networkManager.publish(t, payload, retained, priority);
+  }
+
+  /** Publish a numeric value, see NetworkManager::publishValue() */
+  bool
+  publishValue(Handle handle,
+               float value,
+               uint8_t decimals = 2,
+               bool retained = false,
+               PublishPriority priority = PriorityTelemetry)
+  {
+    const char *t = topic(handle);
+    return t and m_networkManager.publishValue(t, value, decimals, retained, priority);
+  }
+
+  /** Stream a payload encoded in the topic's content format, see
+   * NetworkManager::publishStreamed()
+   */
+  template <typename Encoder>
+  bool
+  publishStreamed(Handle handle,
+                  Encoder encode,
+                  bool retained = false,
+                  PublishPriority priority = PriorityTelemetry)
+  {
+    const char *t = topic(handle);
+    return t and m_networkManager.publishStreamed(t, format(handle), encode, retained, priority);
+  }
+
+  /** Bytes of the arena in use */
+  size_t
+  used()
+  {
+    update();
+    return m_used;
+  }
+
+private:
+  static const uint16_t NoOffset = 0xffff;
+
+  struct Topic
+  {
+    const char *suffix;
+    uint16_t offset;
+    ContentFormat format;
+  };
+
+  void
+  update()
+  {
+    uint32_t generation = m_networkManager.topicPrefixGeneration();
+    if (m_built and generation == m_generation) {
+      return;
+    }
+    m_generation = generation;
+    m_built = true;
+
+    const char *prefix = m_networkManager.topicPrefix();
+    size_t prefixLen = strlen(prefix);
+    m_used = 0;
+    for (size_t i = 0; i < m_numTopics; i++) {
+      Topic &t = m_topics[i];
+      size_t len = prefixLen + 1 + strlen(t.suffix) + 1;
+      if (m_used + len > _ArenaSize) {
+        LOG_ERROR("mqtt", "topic arena full, can not build %s/%s", prefix, t.suffix);
+        t.offset = NoOffset;
+        continue;
+      }
+      char *dst = m_arena + m_used;
+      memcpy(dst, prefix, prefixLen);
+      dst[prefixLen] = '/';
+      strcpy(dst + prefixLen + 1, t.suffix);
+      t.offset = m_used;
+      m_used += len;
+    }
+  }
+
+  NetworkManager &m_networkManager;
+  Topic m_topics[_MaxTopics];
+  size_t m_numTopics;
+  char m_arena[_ArenaSize];
+  size_t m_used;
+  uint32_t m_generation;
+  bool m_built;
+};
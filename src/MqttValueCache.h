@@ -0,0 +1,174 @@
+#pragma once
+
+#include <MqttNetwork.h>
+
+/** Bounded cache of the last value received on subscribed topics.
+ *
+ * Filters are opted in with cache(), after which every matching message
+ * (including retained ones, which the broker sends right after subscribing)
+ * updates the cache. No allocation takes place: entries live in a fixed
+ * table, values in fixed slots of _MaxValueLen bytes. Entries are looked up
+ * by topic hash with open addressing, so lookups are O(1).
+ *
+ * Every update increments the entry's version and the cache wide version,
+ * so consumers can cheaply poll for changes:
+ *
+ *   MqttValueCache<> cache(networkManager);
+ *   cache.cache("config/#");
+ *
+ *   uint32_t seen = 0;
+ *   loop():
+ *     if (cache.version() != seen) {
+ *       const MqttValueCache<>::Entry *e = cache.find("config/interval");
+ *       ...
+ *       seen = cache.version();
+ *     }
+ *
+ * If the table is full, messages on new topics are dropped and counted.
+ * Values longer than _MaxValueLen are truncated (see Entry::truncated).
+ * The cache is kept across reconnects. Topics are identified by their hash
+ * only, topics with colliding hashes share an entry.
+ */
+template <size_t _NumEntries  = 16,
+          size_t _MaxValueLen = 64>
+class MqttValueCache
+{
+public:
+  struct Entry
+  {
+    /* 0 if the entry is unused */
+    uint32_t hash;
+    /* incremented on every update, starts with 1 */
+    uint32_t version;
+    unsigned long updatedMs;
+    uint16_t length;
+    bool truncated;
+    uint8_t value[_MaxValueLen];
+  };
+
+  MqttValueCache(NetworkManager &networkManager)
+    : m_networkManager(networkManager)
+    , m_version(0)
+    , m_numEntries(0)
+    , m_numDropped(0)
+  {
+    memset(m_entries, 0, sizeof(m_entries));
+  }
+
+  /** Subscribe to filter and keep the last value of every matching topic.
+   * @param filter Topic filter, must remain valid (see
+   * NetworkManager::subscribe())
+   */
+  bool
+  cache(const char *filter)
+  {
+    return m_networkManager.subscribe(filter, &MqttValueCache::onMessage, this);
+  }
+
+  const Entry *
+  find(const char *topic) const
+  {
+    return find(topicHash(topic));
+  }
+
+  /** Look up an entry by topic hash (see topicHash()), which can be
+   * precomputed for topics queried often.
+   */
+  const Entry *
+  find(uint32_t hash) const
+  {
+    if (hash == 0) {
+      hash = 1;
+    }
+    size_t idx = hash % _NumEntries;
+    for (size_t i = 0; i < _NumEntries; i++) {
+      const Entry &e = m_entries[idx];
+      if (e.hash == hash) {
+        return &e;
+      }
+      if (e.hash == 0) {
+        return nullptr;
+      }
+      idx = (idx + 1) % _NumEntries;
+    }
+    return nullptr;
+  }
+
+  /** Version of the entry of a topic, 0 if nothing has been received yet */
+  uint32_t
+  version(const char *topic) const
+  {
+    const Entry *e = find(topic);
+    return e ? e->version : 0;
+  }
+
+  /** Incremented whenever any entry changes */
+  uint32_t
+  version() const
+  {
+    return m_version;
+  }
+
+  size_t
+  size() const
+  {
+    return m_numEntries;
+  }
+
+  unsigned long
+  numDropped() const
+  {
+    return m_numDropped;
+  }
+
+private:
+  static void
+  onMessage(void *context, const char *topic, const uint8_t *payload, unsigned int length)
+  {
+    static_cast<MqttValueCache *>(context)->store(topic, payload, length);
+  }
+
+  void
+  store(const char *topic, const uint8_t *payload, unsigned int length)
+  {
+    uint32_t hash = topicHash(topic);
+    if (hash == 0) {
+      /* 0 marks unused entries */
+      hash = 1;
+    }
+
+    size_t idx = hash % _NumEntries;
+    Entry *e = nullptr;
+    for (size_t i = 0; i < _NumEntries; i++) {
+      Entry &candidate = m_entries[idx];
+      if (candidate.hash == hash) {
+        e = &candidate;
+        break;
+      }
+      if (candidate.hash == 0) {
+        e = &candidate;
+        e->hash = hash;
+        m_numEntries++;
+        break;
+      }
+      idx = (idx + 1) % _NumEntries;
+    }
+    if (not e) {
+      m_numDropped++;
+      return;
+    }
+
+    e->truncated = length > _MaxValueLen;
+    e->length = e->truncated ? _MaxValueLen : length;
+    memcpy(e->value, payload, e->length);
+    e->updatedMs = millis();
+    e->version++;
+    m_version++;
+  }
+
+  NetworkManager &m_networkManager;
+  Entry m_entries[_NumEntries];
+  uint32_t m_version;
+  size_t m_numEntries;
+  unsigned long m_numDropped;
+};
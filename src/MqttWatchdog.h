@@ -0,0 +1,355 @@
+#pragma once
+
+#include <MqttLog.h>
+#include <MqttRetained.h>
+#include <Ticker.h>
+
+#ifndef StallRecordRtcBlock
+/* ESP8266: offset of the stall record in the RTC user memory in 4 byte
+ * blocks. Move it if the sketch uses this part of the RTC memory itself.
+ */
+#  define StallRecordRtcBlock 96
+#endif
+
+/** The part of the loop a StallWatchdog is watching */
+typedef enum
+{
+  /* outside of any watched code */
+  PhaseIdle,
+  PhaseWifi,
+  PhaseTelnet,
+  PhaseMqttConnect,
+  PhaseMqttLoop,
+  PhaseLinkHealth,
+  PhaseStats,
+  PhaseLog,
+  PhaseCli,
+  /* available to the sketch, see StallScope */
+  PhaseApp,
+
+  NumLoopPhases,
+} LoopPhase;
+
+inline const char *
+loopPhaseName(LoopPhase phase)
+{
+  static const char *const names[NumLoopPhases] = {
+    "idle",
+    "wifi",
+    "telnet",
+    "mqtt.connect",
+    "mqtt.loop",
+    "link",
+    "stats",
+    "log",
+    "cli",
+    "app",
+  };
+  return phase < NumLoopPhases ? names[phase] : "?";
+}
+
+/** A phase which took longer than its budget. Kept in memory which
+ * survives a (watchdog) reset, see StallRecordStore.
+ */
+struct StallRecord
+{
+  static const uint32_t Magic = 0x5354414c;
+
+  uint32_t magic;
+  uint32_t phase;
+  /* millis() when the phase was entered */
+  uint32_t startMs;
+  uint32_t durationMs;
+  /* recorded while the phase was still running, i.e. the device has likely
+   * been reset before the phase ended
+   */
+  uint32_t unfinished;
+  char detail[16];
+
+  bool
+  valid() const
+  {
+    return magic == Magic and phase < NumLoopPhases;
+  }
+};
+
+/** Keeps one StallRecord across resets, see RetainedMemory */
+class StallRecordStore
+{
+public:
+  static bool
+  load(StallRecord &record)
+  {
+    return Memory::read(record) and record.valid();
+  }
+
+  static void
+  save(const StallRecord &record)
+  {
+    Memory::write(record);
+  }
+
+  static void
+  clear()
+  {
+    StallRecord record;
+    memset(&record, 0, sizeof(record));
+    save(record);
+  }
+
+private:
+  typedef RetainedMemory<StallRecord, StallRecordRtcBlock> Memory;
+};
+
+/** Software watchdog for the main loop.
+ *
+ * The watched code announces which phase it is in. If a phase takes longer
+ * than the budget, the phase, its duration and the time it was entered are
+ * written to a StallRecordStore and the stall is reported over MQTT by the
+ * NetworkManager on the next connect (on "<prefix>/$SYS/stall").
+ *
+ * Phases ending over budget are recorded when they end. Phases which never
+ * end, because the hardware watchdog resets the device first, are caught by
+ * a ticker which records them while they are still running. Note that on
+ * the ESP8266 the ticker only fires while the stalled code yields (e.g.
+ * inside delay() or the network stack), code spinning without yielding is
+ * only recorded if it eventually returns. On the ESP32 the ticker runs in
+ * the esp_timer task concurrently to the loop, the state both share is
+ * guarded by a critical section there.
+ */
+class StallWatchdog
+{
+public:
+  static const unsigned long DefaultBudgetMs = 2000;
+  static const unsigned long TickMs = 250;
+  static const size_t MaxDetailLen = sizeof(StallRecord::detail) - 1;
+
+  /** State of the enclosing phase, see enter() and leave() */
+  struct Scope
+  {
+    LoopPhase phase;
+    char detail[MaxDetailLen + 1];
+  };
+
+  StallWatchdog()
+    : m_phase(PhaseIdle)
+    , m_enterMs(0)
+    , m_recorded(false)
+    , m_budgetMs(DefaultBudgetMs)
+    , m_numStalls(0)
+    , m_pending(false)
+  {
+    m_detail[0] = 0;
+#if defined(ARDUINO_ARCH_ESP32)
+    portMUX_INITIALIZE(&m_mux);
+#endif
+  }
+
+  /** Start the ticker and pick up a stall recorded before the last reset */
+  void
+  begin()
+  {
+    StallRecord record;
+    if (StallRecordStore::load(record)) {
+      m_pending = true;
+      LOG_WARN("wdt", "stall before reset in %s %s: %lu ms",
+               loopPhaseName(static_cast<LoopPhase>(record.phase)),
+               record.detail,
+               static_cast<unsigned long>(record.durationMs));
+    }
+    m_ticker.attach_ms(TickMs, &StallWatchdog::onTick, this);
+  }
+
+  /** Maximum duration of a phase, 0 disables the watchdog */
+  void
+  setBudget(unsigned long budgetMs)
+  {
+    m_budgetMs = budgetMs;
+  }
+
+  unsigned long
+  budgetMs() const
+  {
+    return m_budgetMs;
+  }
+
+  /** End the current phase and start the next one
+   * @param detail Optional further information, e.g. a CLI command. The
+   * first MaxDetailLen characters are copied.
+   */
+  void
+  phase(LoopPhase next, const char *detail = nullptr)
+  {
+    unsigned long now = millis();
+    StallRecord r;
+    lock();
+    bool stalled = m_phase != PhaseIdle and m_budgetMs and now - m_enterMs > m_budgetMs;
+    if (stalled) {
+      record(r, now, false);
+    }
+    m_enterMs = now;
+    m_phase = next;
+    copyDetail(detail);
+    m_recorded = false;
+    unlock();
+
+    if (stalled) {
+      m_numStalls++;
+      m_pending = true;
+      LOG_WARN("wdt", "stall in %s %s: %lu ms",
+               loopPhaseName(static_cast<LoopPhase>(r.phase)), r.detail,
+               static_cast<unsigned long>(r.durationMs));
+    }
+  }
+
+  /** Change the detail of the current phase, see phase() */
+  void
+  setDetail(const char *detail)
+  {
+    lock();
+    copyDetail(detail);
+    unlock();
+  }
+
+  /** Enter a nested phase, the enclosing phase is restored by leave(). Its
+   * duration is measured again from there.
+   */
+  Scope
+  enter(LoopPhase next, const char *detail = nullptr)
+  {
+    Scope outer;
+    lock();
+    outer.phase = m_phase;
+    memcpy(outer.detail, m_detail, sizeof(outer.detail));
+    unlock();
+    phase(next, detail);
+    return outer;
+  }
+
+  void
+  leave(const Scope &outer)
+  {
+    phase(outer.phase, outer.detail);
+  }
+
+  LoopPhase
+  currentPhase() const
+  {
+    return m_phase;
+  }
+
+  unsigned long
+  numStalls() const
+  {
+    return m_numStalls;
+  }
+
+  /** Check for a stall which has not been reported yet */
+  bool
+  pending(StallRecord &record) const
+  {
+    return m_pending and StallRecordStore::load(record);
+  }
+
+  /** Mark the pending stall as reported */
+  void
+  reported()
+  {
+    m_pending = false;
+    StallRecordStore::clear();
+  }
+
+private:
+  void
+  lock()
+  {
+#if defined(ARDUINO_ARCH_ESP32)
+    portENTER_CRITICAL(&m_mux);
+#endif
+  }
+
+  void
+  unlock()
+  {
+#if defined(ARDUINO_ARCH_ESP32)
+    portEXIT_CRITICAL(&m_mux);
+#endif
+  }
+
+  /** Call locked */
+  void
+  copyDetail(const char *detail)
+  {
+    strncpy(m_detail, detail ? detail : "", MaxDetailLen);
+    m_detail[MaxDetailLen] = 0;
+  }
+
+  /** Store the current phase as stall record r, call locked */
+  void
+  record(StallRecord &r, unsigned long now, bool unfinished)
+  {
+    memset(&r, 0, sizeof(r));
+    r.magic = StallRecord::Magic;
+    r.phase = m_phase;
+    r.startMs = m_enterMs;
+    r.durationMs = now - m_enterMs;
+    r.unfinished = unfinished;
+    memcpy(r.detail, m_detail, sizeof(r.detail));
+    StallRecordStore::save(r);
+  }
+
+  static void
+  onTick(StallWatchdog *self)
+  {
+    unsigned long now = millis();
+    StallRecord r;
+    self->lock();
+    if (self->m_phase != PhaseIdle and
+        self->m_budgetMs and
+        not self->m_recorded and
+        now - self->m_enterMs > self->m_budgetMs) {
+      self->m_recorded = true;
+      self->record(r, now, true);
+    }
+    self->unlock();
+  }
+
+  /* shared by the loop and the ticker, see lock() */
+  volatile LoopPhase m_phase;
+  char m_detail[MaxDetailLen + 1];
+  volatile unsigned long m_enterMs;
+  volatile bool m_recorded;
+#if defined(ARDUINO_ARCH_ESP32)
+  portMUX_TYPE m_mux;
+#endif
+
+  unsigned long m_budgetMs;
+  unsigned long m_numStalls;
+  bool m_pending;
+  Ticker m_ticker;
+};
+
+/** Watch a block of code as a phase of its own:
+ *
+ *   {
+ *     StallScope scope(networkManager.getWatchdog(), PhaseApp, "sensor");
+ *     readSensor();
+ *   }
+ */
+class StallScope
+{
+public:
+  StallScope(StallWatchdog &watchdog, LoopPhase phase, const char *detail = nullptr)
+    : m_watchdog(watchdog)
+    , m_outer(watchdog.enter(phase, detail))
+  { }
+
+  ~StallScope()
+  {
+    m_watchdog.leave(m_outer);
+  }
+
+private:
+  StallWatchdog &m_watchdog;
+  StallWatchdog::Scope m_outer;
+};